@@ -52,11 +52,80 @@ to store. */
 from every client. */
 #define DATA_FRAMES_SYNC_DLV (1)
 
+/* Maximum number of synchronized delivery rounds run at once when every client
+has several frames waiting. The DATA frames of a client for those rounds go to
+Tor in a single vectored write. */
+#define SYNC_DLV_MAX_ROUNDS (64)
+
 /* =============================== Connections ============================ */
 
 /* Maximum number of pending connections on the listen socket file descriptor.*/
 #define MAX_LISTEN_USERS (50)
 
+/* Maximum number of events returned by a single epoll_wait() of the reactor. */
+#define REACTOR_MAX_EVENTS (1024)
+
+/* Maximum number of handler calls per connection end on each reactor loop
+before moving to the next ready connection. */
+#define REACTOR_READ_BUDGET (16)
+
+/* Time given to a client to complete the TLS handshake before the bridge drops
+the connection (milliseconds). */
+#define HANDSHAKE_TIMEOUT_MS (10000)
+
+/* Interval between checks for expired TLS handshakes (milliseconds). */
+#define HANDSHAKE_CHECK_MS   (1000)
+
+/* Capacity, in maximum sized frames, of the per-connection buffer that holds
+decrypted TLS data until complete frames can be sliced out of it. */
+#define FDPAIR_RX_FRAMES (4)
+
+/* Bytes queued for a local Tor connection whose socket buffer is full above
+which the bridge stops reading from that connection, and below which it
+resumes. */
+#define LOCAL_OUT_HIGH_WATER (512 * 1024)
+#define LOCAL_OUT_LOW_WATER  (128 * 1024)
+
+/* Data frames queued for a client above which the bridge stops reading from its
+local Tor connection, and at or below which the traffic shaper resumes it. Bounds
+the frames a single Tor stream holds in the frame pool. */
+#define CLIENT_DATA_HIGH_WATER (256)
+#define CLIENT_DATA_LOW_WATER  (64)
+
+/* Interval between updates of the traffic shaper rate from the queue depth,
+chaff share and tick overruns observed by the bridge (milliseconds). */
+#define TS_RATE_UPDATE_MS (1000)
+
+/* Window over which rate changes caused by clients connecting and leaving are
+coalesced into a single TS_RATE broadcast (milliseconds). */
+#define TS_RATE_DEBOUNCE_MS (200)
+
+/* Minimum number of clients handled by each task of a parallel shaper tick
+(--tick_workers), so that small shards are not split into tasks that cost more
+than the writes they overlap. */
+#define TICK_MIN_CLIENTS_PER_TASK (8)
+
+/* Build the io_uring send backend of the bridge (Linux >= 5.6). The backend is
+enabled at runtime with --io_uring and falls back to direct socket writes when
+the kernel does not provide io_uring. */
+#define USE_IO_URING (1)
+
+/* Entries of the submission queue of each shard's io_uring. */
+#define IO_URING_ENTRIES (1024)
+
+/* Bytes that may be queued for a client before the shaper backs off with
+SSL_TRY_LATER, as a blocking socket would. */
+#define IO_URING_MAX_BACKLOG (256 * 1024)
+
+/* ================================ Frame Pool ============================ */
+
+/* Back the frame pools with huge pages: MAP_HUGETLB when the system has huge
+pages reserved, transparent huge pages (MADV_HUGEPAGE) otherwise. */
+#define FRAME_POOL_HUGEPAGES (0)
+
+/* Lock the frames of the pools in memory as the pools grow. */
+#define FRAME_POOL_MLOCK     (0)
+
 /* ============================ Handling Failures ========================= */
 
 /* Maximum number of attempts to create a circuit. */
@@ -126,7 +195,8 @@ from every client. */
     #include  <openssl/err.h>
 #endif
 
-/* Error code for SSL_WANT_READ or SSL_WANT_WRITE */
+/* Error code for SSL_WANT_READ or SSL_WANT_WRITE (or EAGAIN on non-blocking
+sockets) */
 #define SSL_TRY_LATER   (-2)
 
 /* ================================ Functions ============================= */
@@ -0,0 +1,153 @@
+#include "IoUring.hh"
+
+#if USE_IO_URING
+
+#include <errno.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+IoUring::IoUring() : _fd(-1), _to_submit(0), _sq_ptr(MAP_FAILED),
+                     _cq_ptr(MAP_FAILED), _sqes((struct io_uring_sqe *) MAP_FAILED) {}
+
+IoUring::~IoUring()
+{
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqes_sz);
+    }
+    if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) {
+        munmap(_cq_ptr, _cq_sz);
+    }
+    if (_sq_ptr != MAP_FAILED) {
+        munmap(_sq_ptr, _sq_sz);
+    }
+    if (_fd != -1) {
+        close(_fd);
+    }
+}
+
+int IoUring::initialize(unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    _fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (_fd < 0) {
+        _fd = -1;
+        return -errno;
+    }
+
+    _sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    _cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Both rings share one mapping on kernels with IORING_FEAT_SINGLE_MMAP */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _sq_sz = _cq_sz = std::max(_sq_sz, _cq_sz);
+    }
+
+    _sq_ptr = mmap(NULL, _sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   _fd, IORING_OFF_SQ_RING);
+    if (_sq_ptr == MAP_FAILED) {
+        return -errno;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cq_ptr = _sq_ptr;
+    } else {
+        _cq_ptr = mmap(NULL, _cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       _fd, IORING_OFF_CQ_RING);
+        if (_cq_ptr == MAP_FAILED) {
+            return -errno;
+        }
+    }
+
+    _sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe *) mmap(NULL, _sqes_sz, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, _fd,
+                                         IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) {
+        return -errno;
+    }
+
+    _sq_head  = (unsigned int *) ((char *) _sq_ptr + params.sq_off.head);
+    _sq_tail  = (unsigned int *) ((char *) _sq_ptr + params.sq_off.tail);
+    _sq_mask  = (unsigned int *) ((char *) _sq_ptr + params.sq_off.ring_mask);
+    _sq_array = (unsigned int *) ((char *) _sq_ptr + params.sq_off.array);
+
+    _cq_head  = (unsigned int *) ((char *) _cq_ptr + params.cq_off.head);
+    _cq_tail  = (unsigned int *) ((char *) _cq_ptr + params.cq_off.tail);
+    _cq_mask  = (unsigned int *) ((char *) _cq_ptr + params.cq_off.ring_mask);
+    _cqes     = (struct io_uring_cqe *) ((char *) _cq_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+int IoUring::prepSend(int fd, const void *buf, unsigned int len, void *user_data)
+{
+    unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *_sq_tail;
+
+    if (tail - head > *_sq_mask) {
+        return IO_URING_ERR_FULL;
+    }
+
+    unsigned int index = tail & *_sq_mask;
+    struct io_uring_sqe *sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long) user_data;
+
+    _sq_array[index] = index;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    _to_submit++;
+
+    return IO_URING_OK;
+}
+
+int IoUring::submit(unsigned int min_complete)
+{
+    int status;
+
+    if (_to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+
+    do {
+        status = syscall(__NR_io_uring_enter, _fd, _to_submit, min_complete,
+                         min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (status < 0 && errno == EINTR);
+
+    if (status < 0) {
+        return -errno;
+    }
+
+    _to_submit -= status;
+    return status;
+}
+
+bool IoUring::reap(void *(&user_data), int &res)
+{
+    unsigned int head = *_cq_head;
+
+    if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+    user_data = (void *) cqe->user_data;
+    res = cqe->res;
+
+    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+unsigned int IoUring::pending()
+{
+    return _to_submit;
+}
+
+#endif
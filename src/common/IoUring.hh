@@ -0,0 +1,62 @@
+#ifndef IO_URING_HH
+#define IO_URING_HH
+
+#include "Common.hh"
+
+#if USE_IO_URING
+
+#include <linux/io_uring.h>
+
+#define IO_URING_OK           (0)
+#define IO_URING_ERR_FULL     (-1)
+
+/* Minimal io_uring wrapper over the raw system calls: queues sends, submits
+them in one batch and reaps the completions without blocking. Not thread
+safe, callers serialize access. */
+class IoUring {
+
+    public:
+        IoUring();
+
+        ~IoUring();
+
+        /* Returns 0 on success or -errno when io_uring is not available */
+        int initialize(unsigned int entries);
+
+        int prepSend(int fd, const void *buf, unsigned int len, void *user_data);
+
+        /* Submits the queued entries, waiting for at least min_complete
+        completions. Returns the number of submitted entries or -errno. */
+        int submit(unsigned int min_complete);
+
+        /* Pops one completion, returns false when none is available */
+        bool reap(void *(&user_data), int &res);
+
+        unsigned int pending();
+
+    private:
+        int _fd;
+
+        unsigned int _to_submit;
+
+        void *_sq_ptr;
+        size_t _sq_sz;
+        void *_cq_ptr;
+        size_t _cq_sz;
+        struct io_uring_sqe *_sqes;
+        size_t _sqes_sz;
+
+        unsigned int *_sq_head;
+        unsigned int *_sq_tail;
+        unsigned int *_sq_mask;
+        unsigned int *_sq_array;
+
+        unsigned int *_cq_head;
+        unsigned int *_cq_tail;
+        unsigned int *_cq_mask;
+        struct io_uring_cqe *_cqes;
+};
+
+#endif
+
+#endif //IO_URING_HH
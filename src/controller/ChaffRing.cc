@@ -0,0 +1,158 @@
+#include "ChaffRing.hh"
+#include <chrono>
+
+#if USE_SSL
+    #include <openssl/evp.h>
+    #include <openssl/rand.h>
+#endif
+
+ChaffRing::ChaffRing(int chunk_size, int size)
+    : _size(size), _states(new std::atomic<int>[size]),
+      _fallback(1, chunk_size), _next(0), _stale(0), _fallbacks(0),
+      _refills(0), _stop(false)
+{
+    assert(size > 0);
+
+    #if USE_SSL
+        _cipher = EVP_CIPHER_CTX_new();
+        assert(_cipher != NULL);
+        _zeros.assign(chunk_size, 0);
+        reseed();
+    #endif
+
+    _fallback.setFrameType(FRAME_TYPE_CHAFF);
+    fill(&_fallback);
+
+    for (int slot = 0; slot < _size; slot++) {
+        Frame *frame = new Frame(1, chunk_size);
+        frame->setFrameType(FRAME_TYPE_CHAFF);
+        fill(frame);
+        _frames.push_back(frame);
+        _states[slot].store(CHAFF_SLOT_READY, std::memory_order_relaxed);
+    }
+
+    _thread = std::thread(&ChaffRing::refill_thread, this);
+}
+
+ChaffRing::~ChaffRing()
+{
+    {
+        std::unique_lock<std::mutex> res_lock(_mtx);
+        _stop = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+
+    for (Frame *frame : _frames) {
+        delete frame;
+    }
+    #if USE_SSL
+        EVP_CIPHER_CTX_free(_cipher);
+    #endif
+}
+
+int ChaffRing::acquire()
+{
+    unsigned int next = _next.fetch_add(1, std::memory_order_relaxed);
+
+    for (int i = 0; i < CHAFF_RING_PROBES; i++) {
+        int slot = (next + i) % _size;
+        int ready = CHAFF_SLOT_READY;
+        if (_states[slot].compare_exchange_strong(ready, CHAFF_SLOT_IN_USE,
+                                                  std::memory_order_acquire)) {
+            return slot;
+        }
+    }
+
+    //the refill thread is behind, resend the static padding
+    _fallbacks.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+}
+
+void ChaffRing::release(int slot)
+{
+    if (slot < 0) {
+        return;
+    }
+    assert(slot < _size);
+    assert(_states[slot].load(std::memory_order_relaxed) == CHAFF_SLOT_IN_USE);
+
+    _states[slot].store(CHAFF_SLOT_STALE, std::memory_order_release);
+    if (_stale.fetch_add(1, std::memory_order_relaxed) + 1 == _size / 2) {
+        _cv.notify_one();
+    }
+}
+
+void ChaffRing::refill_thread()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> res_lock(_mtx);
+            _cv.wait_for(res_lock, std::chrono::milliseconds(CHAFF_REFILL_MS),
+                [this] {
+                    return _stop ||
+                        _stale.load(std::memory_order_relaxed) >= _size / 2;
+                });
+            if (_stop) {
+                return;
+            }
+        }
+
+        for (int slot = 0; slot < _size; slot++) {
+            if (_states[slot].load(std::memory_order_acquire) != CHAFF_SLOT_STALE) {
+                continue;
+            }
+            fill(_frames[slot]);
+            _states[slot].store(CHAFF_SLOT_READY, std::memory_order_release);
+            _stale.fetch_sub(1, std::memory_order_relaxed);
+            _refills.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+/* Only called from the constructor and the refill thread */
+void ChaffRing::fill(Frame *frame)
+{
+    char *chaff_ptr;
+    int chaff_sz;
+
+    int status = frame->getChaffFrameSpace(chaff_ptr, chaff_sz);
+    assert(status == FRAME_OK);
+
+    #if USE_SSL
+        if (_keystream_bytes + chaff_sz > CHAFF_RESEED_BYTES) {
+            reseed();
+        }
+
+        //encrypting zeros yields the keystream itself
+        int out_sz;
+        status = EVP_EncryptUpdate(_cipher, (unsigned char *) chaff_ptr, &out_sz,
+                                   _zeros.data(), chaff_sz);
+        assert(status == 1 && out_sz == chaff_sz);
+        _keystream_bytes += chaff_sz;
+    #else
+        for (int i = 0; i < chaff_sz; i++) {
+            chaff_ptr[i] = (char) (0xff & rand());
+        }
+    #endif
+}
+
+#if USE_SSL
+void ChaffRing::reseed()
+{
+    unsigned char key[32], iv[16];
+
+    int status = RAND_bytes(key, sizeof(key));
+    assert(status == 1);
+    status = RAND_bytes(iv, sizeof(iv));
+    assert(status == 1);
+
+    status = EVP_EncryptInit_ex(_cipher, EVP_chacha20(), NULL, key, iv);
+    assert(status == 1);
+    _keystream_bytes = 0;
+
+    OPENSSL_cleanse(key, sizeof(key));
+}
+#else
+void ChaffRing::reseed() {}
+#endif
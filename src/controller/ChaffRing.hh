@@ -0,0 +1,89 @@
+#ifndef CHAFF_RING_HH
+#define CHAFF_RING_HH
+
+#include "Frame.hh"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+
+/* Chaff frames kept ready to be sent. Each one is sent at most once between
+two refills. */
+#define CHAFF_RING_SIZE         (512)
+
+/* Slots a sender tries before falling back to the static chaff frame */
+#define CHAFF_RING_PROBES       (4)
+
+/* Longest time the refill thread sleeps between sweeps of the ring, in case a
+wake-up is missed (milliseconds) */
+#define CHAFF_REFILL_MS         (10)
+
+/* Keystream bytes produced under one key before drawing a new key and IV */
+#define CHAFF_RESEED_BYTES      (1L << 30)
+
+#define CHAFF_SLOT_READY        (0)
+#define CHAFF_SLOT_IN_USE       (1)
+#define CHAFF_SLOT_STALE        (2)
+
+/* Ring of single chunk chaff frames whose padding is filled with a ChaCha20
+ * keystream (rand() without SSL) by a background thread. Senders acquire() a
+ * ready frame, send it and release() it, and the thread refills released
+ * frames once half of the ring is stale, so every chaff chunk on the wire
+ * carries fresh padding without generating it on the shaper tick. acquire()
+ * never blocks: with no ready frame at hand it returns -1, which getFrame()
+ * maps to a static chaff frame. */
+class ChaffRing {
+
+    public:
+        ChaffRing(int chunk_size, int size = CHAFF_RING_SIZE);
+
+        ~ChaffRing();
+
+        int acquire();
+
+        void release(int slot);
+
+        Frame* getFrame(int slot) {
+            return (slot < 0) ? &_fallback : _frames[slot];
+        }
+
+        /* Chaff frames refilled and sends that got the static frame */
+        long getRefills() {
+            return _refills.load(std::memory_order_relaxed);
+        }
+
+        long getFallbacks() {
+            return _fallbacks.load(std::memory_order_relaxed);
+        }
+
+    private:
+        void refill_thread();
+
+        void fill(Frame *frame);
+
+        void reseed();
+
+        int _size;
+        std::vector<Frame*> _frames;
+        std::unique_ptr<std::atomic<int>[]> _states;
+        Frame _fallback;
+
+        alignas(64) std::atomic<unsigned int> _next;
+        std::atomic<int> _stale;
+        std::atomic<long> _fallbacks;
+        std::atomic<long> _refills;
+
+        /* Refill thread */
+        std::thread _thread;
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        bool _stop;
+
+        #if USE_SSL
+            EVP_CIPHER_CTX *_cipher;
+            std::vector<unsigned char> _zeros;
+            long _keystream_bytes;
+        #endif
+};
+
+#endif /* CHAFF_RING_HH */
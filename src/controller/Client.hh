@@ -1,6 +1,7 @@
 #ifndef CLIENT_HH
 #define CLIENT_HH
 
+#include <atomic>
 #include "FrameQueue.hh"
 
 #define CLIENT_STATE_UNDEF     (0)
@@ -13,18 +14,81 @@
 #define CLIENT_STATE_SHUT      (7)
 #define CLIENT_STATE_NOT_CONN  (-1)
 
+#define CLIENT_STATE_VALID(S) (S != CLIENT_STATE_NOT_CONN && \
+                               S != CLIENT_STATE_UNDEF    && \
+                               S != CLIENT_STATE_SHUT)
+
 #define CLIENT_K_MIN_UNDEF    (-1)
 
+/* Chunks of the next tick pre-encrypted for the client (--prestage): none,
+being encrypted by the stager or by an inline send of the tick, or ready in
+the memory BIO of the connection */
+#define CLIENT_STAGE_IDLE      (0)
+#define CLIENT_STAGE_BUSY      (1)
+#define CLIENT_STAGE_READY     (2)
+
 #define RECP_DATA_FRAME        (0)
 #define RECP_NON_DATA_FRAME    (1)
 #define RECP_NO_FRAME_AVAIL    (-1)
 
+/* Receptions word of a client: whether the client is valid, whether it got
+frames without data since the last delivery and how many DATA frames it has
+queued. Receptions, deliveries and state changes run on different threads
+and each one updates the word in a single atomic step. */
+#define CLIENT_RECP_VALID      (1 << 30)
+#define CLIENT_RECP_MARK       (1 << 29)
+#define CLIENT_RECP_FRAMES     (CLIENT_RECP_MARK - 1)
+
+class FdPair;
+class Client;
+
+/* Fields of a client read on every tick and k-anonymity check. The owning
+ * ClientManager packs them with the ones of the other clients of the same
+ * partition and points the client at its entry. The tick and the reception
+ * scans walk the entries, and only follow _client for the clients they
+ * pick. */
+struct ClientHot {
+    std::atomic<int> _state{CLIENT_STATE_UNDEF};
+    int _k_min = CLIENT_K_MIN_UNDEF;
+    int _wr_tmp_frame_type = -1;
+    int _wr_tmp_chaff = -1;
+    int _group = 0;
+    std::atomic<int> _stage{CLIENT_STAGE_IDLE};
+
+    FdPair *_fdp = nullptr;
+    Client *_client = nullptr;
+
+    void reset() {
+        _state.store(CLIENT_STATE_UNDEF, std::memory_order_relaxed);
+        _k_min = CLIENT_K_MIN_UNDEF;
+        _wr_tmp_frame_type = -1;
+        _wr_tmp_chaff = -1;
+        _group = 0;
+        _stage.store(CLIENT_STAGE_IDLE, std::memory_order_relaxed);
+        _fdp = nullptr;
+        _client = nullptr;
+    }
+
+    void moveFrom(ClientHot &other) {
+        _state.store(other._state.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+        _k_min = other._k_min;
+        _wr_tmp_frame_type = other._wr_tmp_frame_type;
+        _wr_tmp_chaff = other._wr_tmp_chaff;
+        _group = other._group;
+        _stage.store(other._stage.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+        _fdp = other._fdp;
+        _client = other._client;
+    }
+};
+
 class Client {
 
     public:
-        Client() : _state(CLIENT_STATE_UNDEF), _k_min(CLIENT_K_MIN_UNDEF),
-                   _reception_mark(false), _tmp_frame(nullptr), _tmp_chunk(-1),
-                   _wr_tmp_frame_type(-1) {};
+        Client() : _ctrl_queue(FRAME_QUEUE_MULTI_PRODUCER), _hot(&_own_hot),
+                   _ts_rate(0), _valid_clients(nullptr),
+                   _missing_receptions(nullptr) {};
 
         ~Client() {};
 
@@ -41,29 +105,62 @@ class Client {
         }
 
         int getState() {
-            std::shared_lock<std::shared_mutex> res_lock(_mtx);
-            return _state;
+            return _hot->_state.load();
         }
 
         int getKMin() {
-            return _k_min;
+            return _hot->_k_min;
+        }
+
+        /* Anonymity group of the client, moved by its ClientManager */
+        int getGroup() {
+            return _hot->_group;
         }
 
         void setState(int new_state) {
-            std::unique_lock<std::shared_mutex> res_lock(_mtx);
-            _state = new_state;
+            int old_state = _hot->_state.exchange(new_state);
+            if (CLIENT_STATE_VALID(old_state) == CLIENT_STATE_VALID(new_state)) {
+                return;
+            }
+
+            int delta = CLIENT_STATE_VALID(new_state) ? 1 : -1;
+            int recp = (delta > 0) ? _receptions.fetch_or(CLIENT_RECP_VALID) :
+                                     _receptions.fetch_and(~CLIENT_RECP_VALID);
+            if (_valid_clients != nullptr) {
+                *_valid_clients += delta;
+            }
+            if (_missing_receptions != nullptr && (recp & ~CLIENT_RECP_VALID) == 0) {
+                *_missing_receptions += delta;
+            }
+        }
+
+        /* Counter of valid clients kept by the owning ClientManager, updated
+         * whenever this client enters or leaves a valid state. */
+        void setValidCounter(std::atomic<int> *valid_clients) {
+            _valid_clients = valid_clients;
+        }
+
+        /* Counter of valid clients with nothing received since the last
+         * delivery round, kept by the owning ClientManager. */
+        void setMissingCounter(std::atomic<int> *missing_receptions) {
+            _missing_receptions = missing_receptions;
         }
 
         void setKMin(int k_min) {
-            _k_min = k_min;
+            _hot->_k_min = k_min;
         }
 
         void setReceptionMark() {
-            _reception_mark = true;
+            received(_receptions.fetch_or(CLIENT_RECP_MARK));
+        }
+
+        void pushReceivedFrame(Frame *frame) {
+            _reception_queue.push(frame);
+            received(_receptions.fetch_add(1));
         }
 
         bool getReceptionMark() {
-            return _reception_mark;
+            return (_receptions.load() & CLIENT_RECP_MARK) != 0;
         }
 
         int getTotalDataFrames() {
@@ -78,16 +175,26 @@ class Client {
             return _reception_queue.size();
         }
 
+        /* Delivery rounds this client can take part in: one per queued frame
+        plus one for the frames that carried no data */
+        int getTotalReceptions() {
+            int recp = _receptions.load();
+            return (recp & CLIENT_RECP_FRAMES) + ((recp & CLIENT_RECP_MARK) ? 1 : 0);
+        }
+
         bool receivedFrame() {
-            return !_reception_queue.empty() || _reception_mark;
+            return (_receptions.load() & ~CLIENT_RECP_VALID) != 0;
         }
 
+        /* Consumer side, for the one delivery of the group running at a
+        time, while the owning shard keeps receiving */
         int getReceivedFrame(Frame *(&frame)) {
-            if (!_reception_queue.empty()) {
+            int recp = _receptions.load();
+            if (recp & CLIENT_RECP_FRAMES) {
                 frame = _reception_queue.getFrame();
                 return RECP_DATA_FRAME;
 
-            } else if (_reception_mark) {
+            } else if (recp & CLIENT_RECP_MARK) {
                 return RECP_NON_DATA_FRAME;
 
             } else {
@@ -96,61 +203,109 @@ class Client {
         }
 
         void clearReceivedFrame() {
-            if (!_reception_queue.empty()) {
+            int recp = _receptions.load();
+            if (recp & CLIENT_RECP_FRAMES) {
                 _reception_queue.pop();
+                recp = _receptions.fetch_sub(1) - 1;
 
-            } else if (_reception_mark) {
-                _reception_mark = false;
+            } else if (recp & CLIENT_RECP_MARK) {
+                recp = _receptions.fetch_and(~CLIENT_RECP_MARK) & ~CLIENT_RECP_MARK;
+
+            } else {
+                return;
+            }
+
+            if (_missing_receptions != nullptr && recp == CLIENT_RECP_VALID) {
+                (*_missing_receptions)++;
             }
         }
 
-        Frame* getTmpFrame() {
-            return _tmp_frame;
+        void setWRTmpFrameType(int frame_type) {
+            _hot->_wr_tmp_frame_type = frame_type;
         }
 
-        void setTmpFrame(Frame* tmp_frame) {
-            _tmp_frame = tmp_frame;
+        int getWRTmpFrameType() {
+            return _hot->_wr_tmp_frame_type;
         }
 
-        int getTmpChunk() {
-            return _tmp_chunk;
+        /* Chaff ring slot held while a write of it is pending, since SSL
+        retries must pass the same buffer */
+        void setWRTmpChaff(int slot) {
+            _hot->_wr_tmp_chaff = slot;
         }
 
-        void setTmpChunk(int chunk) {
-            _tmp_chunk = chunk;
+        int getWRTmpChaff() {
+            return _hot->_wr_tmp_chaff;
         }
 
-        void setWRTmpFrameType(int frame_type) {
-            _wr_tmp_frame_type = frame_type;
+        /* Latest rate ordered to the client. TS_RATE frames still queued
+         * with another rate are stale and dropped unsent. */
+        void setTsRate(unsigned int rate) {
+            _ts_rate.store(rate);
         }
 
-        int getWRTmpFrameType() {
-            return _wr_tmp_frame_type;
+        unsigned int getTsRate() {
+            return _ts_rate.load();
+        }
+
+        /* Claims the client to write its next chunks, unless they are ready
+        or someone else is writing them */
+        bool beginStage() {
+            int idle = CLIENT_STAGE_IDLE;
+            return _hot->_stage.compare_exchange_strong(idle, CLIENT_STAGE_BUSY,
+                                                        std::memory_order_acquire);
+        }
+
+        void endStage(bool ready) {
+            _hot->_stage.store(ready ? CLIENT_STAGE_READY : CLIENT_STAGE_IDLE,
+                               std::memory_order_release);
+        }
+
+        bool stageReady() {
+            return _hot->_stage.load(std::memory_order_acquire) == CLIENT_STAGE_READY;
         }
 
 
     private:
+        /* Called with the receptions word before a frame was recorded */
+        void received(int recp) {
+            if (_missing_receptions != nullptr && recp == CLIENT_RECP_VALID) {
+                (*_missing_receptions)--;
+            }
+        }
+
         FrameQueue _data_queue;
         FrameQueue _ctrl_queue;
 
         FrameQueue _reception_queue;
-
-        /* store tmp frame and chunk for SSL_TRY_LATER:
-         * openssl requires to call SSL_read / SSL_write using the same parameters when
-         * returning SSL_WANT_READ / SSL_WANT_WRITE. These parameters save the last frame and chunk
-         * used when a SSL_WANT_READ / SSL_WANT_WRITE occurred.
+        std::atomic<int> _receptions{0};
+
+        /* store tmp frame type for SSL_TRY_LATER:
+         * openssl requires to call SSL_write using the same parameters when
+         * returning SSL_WANT_WRITE. This saves the type of the frame being written
+         * when a SSL_WANT_WRITE occurred. Reads are resumed from the receive
+         * buffer of the FdPair instead. Kept with the state, k_min and
+         * stage in _hot, the entry of the client in the table of its
+         * partition, or _own_hot while it belongs to none.
          * */
-        Frame* _tmp_frame;
-        int _tmp_chunk;
-        int _wr_tmp_frame_type;
+        ClientHot *_hot;
+        ClientHot _own_hot;
 
-        int _state;
+        std::atomic<unsigned int> _ts_rate;
 
-        int _k_min;
+        std::atomic<int> *_valid_clients;
 
-        bool _reception_mark;
+        std::atomic<int> *_missing_receptions;
 
-        std::shared_mutex _mtx;
+        /* Links of the bridge's index of active and waiting clients, guarded
+         * by the index. _idx_state is the state the client is filed under. */
+        friend class ClientIndex;
+        friend class ClientManager;
+        FdPair *_fdp = nullptr;
+        Client *_idx_prev = nullptr;
+        Client *_idx_next = nullptr;
+        int _idx_state = CLIENT_STATE_UNDEF;
+        int _idx_k_min = CLIENT_K_MIN_UNDEF;
 
 };
 
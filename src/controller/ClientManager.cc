@@ -1,84 +1,287 @@
 #include "ClientManager.hh"
 
-ClientManager::ClientManager() {
+std::map<int, Client*>* ClientIndex::buckets(int state) {
+    if (state == CLIENT_STATE_ACTIVE) {
+        return &_active;
+    }
+    if (state == CLIENT_STATE_WAIT) {
+        return &_waiting;
+    }
+    return nullptr;
+}
+
+void ClientIndex::remove(Client *client) {
+    std::map<int, Client*> *m = buckets(client->_idx_state);
+    if (m == nullptr) {
+        return;
+    }
+
+    if (client->_idx_prev != nullptr) {
+        client->_idx_prev->_idx_next = client->_idx_next;
+    } else if (client->_idx_next != nullptr) {
+        (*m)[client->_idx_k_min] = client->_idx_next;
+    } else {
+        m->erase(client->_idx_k_min);
+    }
+    if (client->_idx_next != nullptr) {
+        client->_idx_next->_idx_prev = client->_idx_prev;
+    }
+
+    client->_idx_prev = client->_idx_next = nullptr;
+    client->_idx_state = CLIENT_STATE_UNDEF;
+}
+
+void ClientIndex::relink(Client *client) {
+    std::unique_lock<std::mutex> res_lock(_mtx);
+    int state = client->getState();
+    int k_min = client->getKMin();
+
+    if (client->_idx_state == state && client->_idx_k_min == k_min) {
+        return;
+    }
+
+    remove(client);
+
+    std::map<int, Client*> *m = buckets(state);
+    if (m != nullptr) {
+        Client *&head = (*m)[k_min];
+        client->_idx_next = head;
+        if (head != nullptr) {
+            head->_idx_prev = client;
+        }
+        head = client;
+    }
+    client->_idx_state = state;
+    client->_idx_k_min = k_min;
+}
+
+void ClientIndex::unlink(Client *client) {
+    std::unique_lock<std::mutex> res_lock(_mtx);
+    remove(client);
+}
+
+void ClientIndex::collect(int state, int connected, bool fulfilled,
+                          std::vector<FdPair*> &out) {
+    std::unique_lock<std::mutex> res_lock(_mtx);
+    std::map<int, Client*> *m = buckets(state);
+    assert(m != nullptr);
+
+    auto begin = fulfilled ? m->begin() : m->upper_bound(connected);
+    auto end = fulfilled ? m->upper_bound(connected) : m->end();
+
+    for (auto it = begin; it != end; it++) {
+        for (Client *client = it->second; client != nullptr;
+             client = client->_idx_next) {
+            out.push_back(client->_fdp);
+        }
+    }
+}
 
+ClientManager::ClientManager(int partitions, int groups) {
+    assert(partitions > 0 && groups > 0);
+    for (int i = 0; i < partitions; i++) {
+        _partitions.push_back(new ClientPartition());
+    }
+    for (int i = 0; i < groups; i++) {
+        _groups.push_back(new ClientGroup());
+    }
 }
 
 ClientManager::~ClientManager() {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        delete _clients[x.first];
+    for (ClientPartition *p : _partitions) {
+        {
+            std::unique_lock<std::shared_mutex> res_lock(p->_mtx);
+            p->walk(0, p->size(), [](ClientHot *hot) {
+                delete hot->_client;
+            });
+        }
+        delete p;
     }
+    for (ClientGroup *g : _groups) {
+        delete g;
+    }
+}
+
+ClientPartition* ClientManager::partition(FdPair *fdp) {
+    assert(fdp->getShard() >= 0 && fdp->getShard() < (int) _partitions.size());
+    return _partitions[fdp->getShard()];
+}
+
+ClientGroup* ClientManager::group(Client *client) {
+    return _groups[client->getGroup()];
 }
 
 void ClientManager::add_client(FdPair *fdp) {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-    _clients.insert(std::make_pair(fdp, new Client()));
+    ClientPartition *p = partition(fdp);
+    std::unique_lock<std::shared_mutex> res_lock(p->_mtx);
+    assert(fdp->getClientSlot() == -1);
+
+    int slot = p->size();
+    if (slot == (int) p->_hot_blocks.size() * CLIENT_TABLE_BLOCK) {
+        p->_hot_blocks.push_back(new ClientHot[CLIENT_TABLE_BLOCK]);
+    }
+
+    Client *client = new Client();
+    client->_fdp = fdp;
+    client->_hot = p->hot(slot);
+    client->_hot->reset();
+    client->_hot->_fdp = fdp;
+    client->_hot->_client = client;
+    client->setValidCounter(&_groups[0]->_valid_clients);
+    client->setMissingCounter(&_groups[0]->_missing_receptions);
+    _groups[0]->_clients++;
+
+    p->_size++;
+    fdp->setClientSlot(slot);
 }
 
-void ClientManager::remove_client(FdPair *fdp, FramePool *frame_pool) {
+void ClientManager::remove_client(FdPair *fdp, FramePool *frame_pool,
+                                  ChaffRing *chaff_ring) {
     int status;
+    ClientPartition *p = partition(fdp);
     {
-        std::unique_lock<std::shared_mutex> res_lock(_mtx);
-        assert(_clients.find(fdp) != _clients.end());
+        std::unique_lock<std::shared_mutex> res_lock(p->_mtx);
+        int slot = p->slot(fdp);
+        int last = p->size() - 1;
+        Client *client = p->hot(slot)->_client;
         assert(frame_pool != nullptr);
-        status = unallocFramesFromClient(_clients[fdp], frame_pool);
+        status = unallocFramesFromClient(client, frame_pool);
         assert(status == FRAME_POOL_OK);
+        if (chaff_ring != nullptr) {
+            chaff_ring->release(client->getWRTmpChaff());
+        }
+
+        ClientGroup *g = group(client);
+        if (VALID_CLIENT(client)) {
+            g->_valid_clients--;
+            if (!client->receivedFrame()) {
+                g->_missing_receptions--;
+            }
+        }
+        g->_index.unlink(client);
+        g->_clients--;
+
+        //move the last client into the hole to keep the table dense
+        if (slot != last) {
+            ClientHot *hot = p->hot(slot);
+            hot->moveFrom(*p->hot(last));
+            hot->_client->_hot = hot;
+            hot->_fdp->setClientSlot(slot);
+        }
+        p->hot(last)->reset();
+        p->_size--;
+        fdp->setClientSlot(-1);
+
+        delete client;
+    }
+}
+
+int ClientManager::unallocDataFrames(FdPair *fdp, FramePool *frame_pool) {
+    Frame *frame;
+    int status = 0;
+    ClientPartition *p = partition(fdp);
 
-        delete _clients[fdp];
-        _clients.erase(fdp);
+    std::unique_lock<std::shared_mutex> res_lock(p->_mtx);
+
+    FrameQueue *queue = p->client(fdp)->getDataQueue();
+    while (!queue->empty()) {
+        frame = queue->getFrame();
+        queue->pop();
+        status += frame_pool->unallocFrame(frame);
     }
+
+    return status;
 }
 
 FrameQueue* ClientManager::getDataQueue(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getDataQueue();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->client(fdp)->getDataQueue();
+}
+
+Client* ClientManager::getClient(FdPair *fdp) {
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->client(fdp);
 }
 
 FrameQueue* ClientManager::getCtrlQueue(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getCtrlQueue();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->client(fdp)->getCtrlQueue();
 }
 
 FrameQueue* ClientManager::getReceptionQueue(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getReceptionQueue();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->client(fdp)->getReceptionQueue();
 }
 
-Frame* ClientManager::getTmpFrame(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getTmpFrame();
+void ClientManager::safeIterate(std::function<void(FdPair*, Client*)> f) {
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+        p->walk(0, p->size(), [&f](ClientHot *hot) {
+            f(hot->_fdp, hot->_client);
+        });
+    }
 }
 
-void ClientManager::setTmpFrame(FdPair *fdp, Frame *frame) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    _clients[fdp]->setTmpFrame(frame);
+void ClientManager::safeIterate(int partition, std::function<void(FdPair*, Client*)> f,
+                                const std::vector<char> *due) {
+    assert(partition >= 0 && partition < (int) _partitions.size());
+    ClientPartition *p = _partitions[partition];
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    p->walk(0, p->size(), [&f, due](ClientHot *hot) {
+        if (due == nullptr || (*due)[hot->_group]) {
+            f(hot->_fdp, hot->_client);
+        }
+    });
 }
 
-int ClientManager::getTmpChunk(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getTmpChunk();
-}
+void ClientManager::parallelIterate(int partition, ThreadPool *pool, int n_tasks,
+                                    std::function<void(FdPair*, Client*)> f,
+                                    const std::vector<char> *due) {
+    assert(partition >= 0 && partition < (int) _partitions.size());
+    ClientPartition *p = _partitions[partition];
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+
+    //the table cannot change while the lock is held, slice it in place
+    int n_clients = p->size();
+
+    n_tasks = std::min(n_tasks, (n_clients + TICK_MIN_CLIENTS_PER_TASK - 1) /
+                                TICK_MIN_CLIENTS_PER_TASK);
+
+    std::vector<std::future<int>> results;
+    for (int task = 1; task < n_tasks; task++) {
+        int begin = n_clients * task / n_tasks;
+        int end = n_clients * (task + 1) / n_tasks;
+
+        results.push_back(pool->submit([p, &f, due, begin, end]() {
+            p->walk(begin, end, [&f, due](ClientHot *hot) {
+                if (due == nullptr || (*due)[hot->_group]) {
+                    f(hot->_fdp, hot->_client);
+                }
+            });
+            return 0;
+        }));
+    }
 
-void ClientManager::setTmpChunk(FdPair *fdp, int chunk) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    _clients[fdp]->setTmpChunk(chunk);
-}
+    int end = (n_tasks > 1) ? n_clients / n_tasks : n_clients;
+    p->walk(0, end, [&f, due](ClientHot *hot) {
+        if (due == nullptr || (*due)[hot->_group]) {
+            f(hot->_fdp, hot->_client);
+        }
+    });
 
-void ClientManager::safeIterate(std::function<void(FdPair*, Client*)> f) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        f(x.first, x.second);
+    for (std::future<int> &result : results) {
+        result.wait();
     }
 }
 
+int ClientManager::getNumberPartitions() {
+    return _partitions.size();
+}
+
 int ClientManager::updateClientState(FdPair *fdp, int new_state) {
     if (new_state != CLIENT_STATE_CONNECTED && new_state != CLIENT_STATE_ACTIVE &&
         new_state != CLIENT_STATE_INACTIVE && new_state != CLIENT_STATE_WAIT &&
@@ -86,9 +289,11 @@ int ClientManager::updateClientState(FdPair *fdp, int new_state) {
             return CLIENT_MANAGER_ERR_INVALID;
     }
 
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    _clients[fdp]->setState(new_state);
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    Client *client = p->client(fdp);
+    client->setState(new_state);
+    group(client)->_index.relink(client);
 
     return CLIENT_MANAGER_OK;
 }
@@ -98,156 +303,238 @@ int ClientManager::updateClientKMin(FdPair *fdp, int k_min) {
         return CLIENT_MANAGER_ERR_INVALID;
     }
 
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    _clients[fdp]->setKMin(k_min);
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    Client *client = p->client(fdp);
+    client->setKMin(k_min);
+    group(client)->_index.relink(client);
+
+    return CLIENT_MANAGER_OK;
+}
+
+int ClientManager::updateClientGroup(FdPair *fdp, int new_group) {
+    if (new_group < 0 || new_group >= (int) _groups.size()) {
+        return CLIENT_MANAGER_ERR_INVALID;
+    }
+
+    //hold off receptions and deliveries of the client while its counters move
+    ClientPartition *p = partition(fdp);
+    std::unique_lock<std::shared_mutex> res_lock(p->_mtx);
+    Client *client = p->client(fdp);
+    ClientGroup *from = group(client);
+    ClientGroup *to = _groups[new_group];
+
+    if (from == to) {
+        return CLIENT_MANAGER_OK;
+    }
+
+    from->_index.unlink(client);
+    from->_clients--;
+    to->_clients++;
+    if (VALID_CLIENT(client)) {
+        from->_valid_clients--;
+        to->_valid_clients++;
+        if (!client->receivedFrame()) {
+            from->_missing_receptions--;
+            to->_missing_receptions++;
+        }
+    }
+
+    p->hot(p->slot(fdp))->_group = new_group;
+    client->setValidCounter(&to->_valid_clients);
+    client->setMissingCounter(&to->_missing_receptions);
+    to->_index.relink(client);
 
     return CLIENT_MANAGER_OK;
 }
 
+int ClientManager::getClientGroup(FdPair *fdp) {
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->hot(p->slot(fdp))->_group;
+}
+
+int ClientManager::getNumberGroups() {
+    return _groups.size();
+}
+
+int ClientManager::getGroupSize(int group) {
+    assert(group >= 0 && group < (int) _groups.size());
+    return _groups[group]->_clients;
+}
+
 bool ClientManager::empty() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    return _clients.empty();
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+        if (p->size() != 0) {
+            return false;
+        }
+    }
+    return true;
 }
 
 int ClientManager::getNumberClients() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    return connectedClients();
+    int total = 0;
+    for (ClientGroup *g : _groups) {
+        total += g->_valid_clients;
+    }
+    return total;
+}
+
+int ClientManager::getNumberClients(int group) {
+    return connectedClients(group);
 }
 
 int ClientManager::size() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    return _clients.size();
+    int total = 0;
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+        total += p->size();
+    }
+    return total;
 }
 
 int ClientManager::getTotalDataFrames() {
     int total = 0;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        total += x.second->getTotalDataFrames();
-    }
+    safeIterate([&total](FdPair *fdp, Client *client) {
+        total += client->getTotalDataFrames();
+    });
+    return total;
+}
+
+int ClientManager::getTotalDataFrames(int group) {
+    int total = 0;
+    safeIterate([&total, group](FdPair *fdp, Client *client) {
+        if (client->getGroup() == group) {
+            total += client->getTotalDataFrames();
+        }
+    });
     return total;
 }
 
 int ClientManager::getTotalCtrlFrames() {
     int total = 0;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        total += x.second->getTotalCtrlFrames();
-    }
+    safeIterate([&total](FdPair *fdp, Client *client) {
+        total += client->getTotalCtrlFrames();
+    });
     return total;
 }
 
 int ClientManager::getTotalRecpFrames() {
     int total = 0;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        total += x.second->getTotalReceptionFrames();
-    }
+    safeIterate([&total](FdPair *fdp, Client *client) {
+        total += client->getTotalReceptionFrames();
+    });
     return total;
 }
 
 int ClientManager::getClientState(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getState();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->hot(p->slot(fdp))->_state.load();
 }
 
 int ClientManager::getClientKMin(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    return _clients[fdp]->getKMin();
-}
-
-std::set<FdPair*> ClientManager::getBrokenClients() {
-    std::set<FdPair*> broken_clients;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    int connected_clients = connectedClients();
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (x.second->getState() == CLIENT_STATE_ACTIVE &&
-            connected_clients < x.second->getKMin()) {
-            broken_clients.insert(x.first);
-        }
-    }
-    return broken_clients;
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    return p->hot(p->slot(fdp))->_k_min;
 }
 
-std::set<FdPair*> ClientManager::getFulfilledClients() {
-    std::set<FdPair*> fulfilled_clients;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    int connected_clients = connectedClients();
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (x.second->getState() == CLIENT_STATE_ACTIVE &&
-           connected_clients >= x.second->getKMin()) {
-            fulfilled_clients.insert(x.first);
-        }
-    }
-    return fulfilled_clients;
+void ClientManager::getBrokenClients(int group, std::vector<FdPair*> &out) {
+    out.clear();
+    _groups[group]->_index.collect(CLIENT_STATE_ACTIVE, connectedClients(group),
+                                   false, out);
 }
 
-std::set<FdPair*> ClientManager::getWaitingFulfilledClients() {
-    std::set<FdPair*> fulfilled_clients;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    int connected_clients = connectedClients();
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (x.second->getState() == CLIENT_STATE_WAIT &&
-           connected_clients >= x.second->getKMin()) {
-            fulfilled_clients.insert(x.first);
-        }
-    }
-    return fulfilled_clients;
+void ClientManager::getFulfilledClients(int group, std::vector<FdPair*> &out) {
+    out.clear();
+    _groups[group]->_index.collect(CLIENT_STATE_ACTIVE, connectedClients(group),
+                                   true, out);
+}
+
+void ClientManager::getWaitingFulfilledClients(int group, std::vector<FdPair*> &out) {
+    out.clear();
+    _groups[group]->_index.collect(CLIENT_STATE_WAIT, connectedClients(group),
+                                   true, out);
 }
 
 bool ClientManager::isClientBroken(FdPair *fdp) {
-    assert(_clients.find(fdp) != _clients.end());
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    int connected_clients = connectedClients();
-    int client_k_min  = _clients[fdp]->getKMin();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    ClientHot *hot = p->hot(p->slot(fdp));
+    int connected_clients = connectedClients(hot->_group);
+    int client_k_min  = hot->_k_min;
     return connected_clients < client_k_min;
 }
 
-int ClientManager::connectedClients() {
-    int total = 0;
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (VALID_CLIENT(x.second)) {
-            total++;
-        }
-    }
-    return total;
+int ClientManager::connectedClients(int group) {
+    assert(group >= 0 && group < (int) _groups.size());
+    return _groups[group]->_valid_clients;
 }
 
-bool ClientManager::handleReceptionFrames(std::function<void(FdPair*, Client*)> f) {
-    bool received_all = true;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.empty() == false);
+int ClientManager::handleReceptionFrames(int group, int max_rounds,
+                                         std::function<void(FdPair*, Client*, int)> f) {
+    int rounds = max_rounds;
+    bool any_valid = false;
 
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (VALID_CLIENT(x.second)) {
-            received_all = received_all && x.second->receivedFrame();
-            if (!received_all)
-                return false;
-        }
+    assert(group >= 0 && group < (int) _groups.size());
+    ClientGroup *g = _groups[group];
+    if (g->_missing_receptions > 0) {
+        return 0;
     }
 
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        if (VALID_CLIENT(x.second))
-            f(x.first, x.second);
+    /* One delivery of the group at a time, the one that went first may have
+    consumed the round. Shards are held one at a time, clients that join or
+    leave the group in between are checked again by the delivery. */
+    std::unique_lock<std::mutex> dlv_lock(g->_dlv_mtx);
+    if (g->_missing_receptions > 0) {
+        return 0;
     }
 
-    return true;
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+        p->walk(0, p->size(), [group, &rounds, &any_valid](ClientHot *hot) {
+            if (hot->_group == group && CLIENT_STATE_VALID(hot->_state.load())) {
+                rounds = std::min(rounds, hot->_client->getTotalReceptions());
+                any_valid = true;
+            }
+        });
+    }
+
+    if (!any_valid || rounds == 0) {
+        return 0;
+    }
+
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+        p->walk(0, p->size(), [group, rounds, &f](ClientHot *hot) {
+            if (hot->_group == group && CLIENT_STATE_VALID(hot->_state.load()))
+                f(hot->_fdp, hot->_client, rounds);
+        });
+    }
+
+    return rounds;
 }
 
 void ClientManager::setReceptionMark(FdPair *fdp) {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    assert(_clients.find(fdp) != _clients.end());
-    _clients[fdp]->setReceptionMark();
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    p->client(fdp)->setReceptionMark();
+}
+
+void ClientManager::pushReceptionFrame(FdPair *fdp, Frame *frame) {
+    ClientPartition *p = partition(fdp);
+    std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
+    p->client(fdp)->pushReceivedFrame(frame);
 }
 
 Client* ClientManager::getClientInstance() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+    for (ClientPartition *p : _partitions) {
+        std::shared_lock<std::shared_mutex> res_lock(p->_mtx);
 
-    for (std::pair<FdPair*, Client*> x : _clients) {
-        return x.second;
+        if (p->size() != 0) {
+            return p->hot(0)->_client;
+        }
     }
 
     return nullptr;
@@ -3,28 +3,140 @@
 
 #include <map>
 #include <set>
+#include <algorithm>
 #include <functional>
 #include "Client.hh"
 #include "FdPair.hh"
 #include "FramePool.hh"
+#include "ChaffRing.hh"
+#include "../common/ThreadPool.hh"
 
 #define CLIENT_MANAGER_OK          (0)
 #define CLIENT_MANAGER_ERR_INVALID (-1)
 
-#define VALID_CLIENT(C) (C->getState() != CLIENT_STATE_NOT_CONN && \
-                         C->getState() != CLIENT_STATE_UNDEF    && \
-                         C->getState() != CLIENT_STATE_SHUT)
+#define VALID_CLIENT(C) (CLIENT_STATE_VALID(C->getState()))
+
+/* Entries of the blocks of hot client fields of a partition. Blocks are never
+moved, so clients keep pointing at their entry as the table grows. */
+#define CLIENT_TABLE_BLOCK (256)
+
+/* Clients owned by one shard (reactor thread) of the bridge, in a dense table.
+ * Slot i holds the hot fields hot(i) of a client, which lead to the client and
+ * its FdPair; slots stay packed at [0, size()) by moving the last client into
+ * the slot of a removed one. Each FdPair keeps the slot of its client. */
+struct ClientPartition {
+    ~ClientPartition() {
+        for (ClientHot *block : _hot_blocks) {
+            delete[] block;
+        }
+    }
+
+    ClientHot* hot(int slot) {
+        return &_hot_blocks[slot / CLIENT_TABLE_BLOCK][slot % CLIENT_TABLE_BLOCK];
+    }
+
+    int slot(FdPair *fdp) {
+        int slot = fdp->getClientSlot();
+        assert(slot >= 0 && slot < _size && hot(slot)->_fdp == fdp);
+        return slot;
+    }
+
+    Client* client(FdPair *fdp) {
+        return hot(slot(fdp))->_client;
+    }
+
+    int size() {
+        return _size;
+    }
+
+    /* Calls f on the hot fields of the slots in [begin, end), one block at
+    a time */
+    template<typename F>
+    void walk(int begin, int end, F f) {
+        while (begin < end) {
+            ClientHot *block = _hot_blocks[begin / CLIENT_TABLE_BLOCK];
+            int stop = std::min(end, begin - begin % CLIENT_TABLE_BLOCK +
+                                     CLIENT_TABLE_BLOCK);
+            for (ClientHot *hot = &block[begin % CLIENT_TABLE_BLOCK];
+                 begin < stop; begin++, hot++) {
+                f(hot);
+            }
+        }
+    }
+
+    int _size = 0;
+    std::vector<ClientHot*> _hot_blocks;
+    std::shared_mutex _mtx;
+};
+
+/* Active and waiting clients in intrusive lists bucketed by k_min, so the
+ * clients broken or fulfilled at a number of valid clients are found without
+ * scanning the others. Clients are filed by their current state and k_min on
+ * every relink(). */
+class ClientIndex {
+
+public:
+    void relink(Client *client);
+
+    void unlink(Client *client);
+
+    /* Appends the clients in state whose k_min is at most connected
+    (fulfilled) or above it (broken) */
+    void collect(int state, int connected, bool fulfilled,
+                 std::vector<FdPair*> &out);
+
+private:
+    std::map<int, Client*>* buckets(int state);
+
+    void remove(Client *client);
+
+    std::map<int, Client*> _active;
+    std::map<int, Client*> _waiting;
+    std::mutex _mtx;
+
+};
+
+/* Clients of one anonymity group. k-anonymity counts, the index of active
+ * and waiting clients and synchronized delivery only involve the clients of
+ * the same group. Clients join group 0 and may be moved once. */
+struct ClientGroup {
+    std::atomic<int> _clients{0};
+
+    /* Valid clients, maintained by the clients on every state change so
+    that k-anonymity checks need no full scan */
+    std::atomic<int> _valid_clients{0};
+
+    /* Valid clients that have received nothing since the last delivery, kept
+    by the clients so that synchronized delivery needs no scan to know when
+    to fire */
+    std::atomic<int> _missing_receptions{0};
+
+    /* Serializes the deliveries of the group, the only consumers of the
+    receptions of its clients */
+    std::mutex _dlv_mtx;
+
+    ClientIndex _index;
+};
 
 class ClientManager {
 
 public:
-    ClientManager();
+    ClientManager(int partitions = 1, int groups = 1);
 
     ~ClientManager();
 
     void add_client(FdPair *fdp);
 
-    void remove_client(FdPair *fdp, FramePool *frame_pool);
+    /* Returns the frames of the client to frame_pool and the chaff frame it
+    may hold to chaff_ring */
+    void remove_client(FdPair *fdp, FramePool *frame_pool,
+                       ChaffRing *chaff_ring = nullptr);
+
+    /* Drops the pending data frames of a client from outside the traffic
+    shaper, which is the only other consumer of the queue */
+    int unallocDataFrames(FdPair *fdp, FramePool *frame_pool);
+
+    Client* getClient(FdPair *fdp);
 
     FrameQueue* getDataQueue(FdPair *fdp);
 
@@ -32,28 +144,49 @@ public:
 
     FrameQueue* getReceptionQueue(FdPair *fdp);
 
-    Frame* getTmpFrame(FdPair *fdp);
-
-    void setTmpFrame(FdPair *fdp, Frame *frame);
+    void safeIterate(std::function<void(FdPair*, Client*)> f);
 
-    int getTmpChunk(FdPair *fdp);
+    /* Skips the clients of the groups whose entry in due is 0, if given,
+    without touching them */
+    void safeIterate(int partition, std::function<void(FdPair*, Client*)> f,
+                     const std::vector<char> *due = nullptr);
 
-    void setTmpChunk(FdPair *fdp, int chunk);
+    /* Splits the clients of a partition in up to n_tasks slices, runs all but
+    one on the pool and the last one on the calling thread. Returns once every
+    slice is done. f must only touch the client it is given. */
+    void parallelIterate(int partition, ThreadPool *pool, int n_tasks,
+                         std::function<void(FdPair*, Client*)> f,
+                         const std::vector<char> *due = nullptr);
 
-    void safeIterate(std::function<void(FdPair*, Client*)> f);
+    int getNumberPartitions();
 
     int updateClientState(FdPair *fdp, int new_state);
 
     int updateClientKMin(FdPair *fdp, int k_min);
 
+    /* Moves a client to another anonymity group, along with its share of
+    the group counters */
+    int updateClientGroup(FdPair *fdp, int group);
+
+    int getClientGroup(FdPair *fdp);
+
+    int getNumberGroups();
+
+    /* Clients of a group, valid or not */
+    int getGroupSize(int group);
+
     bool empty();
 
     int getNumberClients();
 
+    int getNumberClients(int group);
+
     int size();
 
     int getTotalDataFrames();
 
+    int getTotalDataFrames(int group);
+
     int getTotalCtrlFrames();
 
     int getTotalRecpFrames();
@@ -62,28 +195,43 @@ public:
 
     int getClientKMin(FdPair *fdp);
 
-    std::set<FdPair*> getBrokenClients();
+    /* Fill out (cleared first) with the matching clients, so callers can
+    reuse its storage */
+    void getBrokenClients(int group, std::vector<FdPair*> &out);
 
-    std::set<FdPair*> getFulfilledClients();
+    void getFulfilledClients(int group, std::vector<FdPair*> &out);
 
-    std::set<FdPair*> getWaitingFulfilledClients();
+    void getWaitingFulfilledClients(int group, std::vector<FdPair*> &out);
 
     bool isClientBroken(FdPair *fdp);
 
-    bool handleReceptionFrames(std::function<void(FdPair*, Client*)> f);
+    /* Runs a delivery once every valid client of a group has received a
+    frame, calling f(fdp, client, rounds) for each of them. rounds (at most
+    max_rounds) is the number of frames every one of them has received, which
+    f must consume, or all a client has if it became valid since they were
+    counted. Returns rounds, 0 when some client is still missing a frame.
+    Receptions may be recorded meanwhile by the shards. */
+    int handleReceptionFrames(int group, int max_rounds,
+                              std::function<void(FdPair*, Client*, int)> f);
 
     void setReceptionMark(FdPair *fdp);
 
+    void pushReceptionFrame(FdPair *fdp, Frame *frame);
+
     Client* getClientInstance();
 
 private:
-    int connectedClients();
+    int connectedClients(int group);
+
+    ClientGroup* group(Client *client);
+
+    ClientPartition* partition(FdPair *fdp);
 
     int unallocFramesFromClient(Client* client, FramePool *frame_pool);
 
-    std::map<FdPair*, Client*> _clients;
+    std::vector<ClientPartition*> _partitions;
 
-    std::shared_mutex _mtx;
+    std::vector<ClientGroup*> _groups;
 
 };
 
@@ -4,6 +4,26 @@
 #include "FdPair.hh"
 #include "Frame.hh"
 
+/* Data frames read from a local connection fill up to --max_chunks chunks
+(fixed), or take one chunk while the data queue of the client is short and
+grow towards --max_chunks as it deepens (auto) */
+#define FRAME_SIZING_FIXED      (1)
+#define FRAME_SIZING_AUTO       (2)
+
+#define VALID_FRAME_SIZING(s)   (s == FRAME_SIZING_FIXED || s == FRAME_SIZING_AUTO)
+
+/* Queued data frames per extra chunk of a new frame in auto sizing */
+#define FRAME_AUTO_DEPTH        (2)
+
+/* Chunks a data frame may take with `queued` frames ahead of it */
+inline int frame_sizing_chunks(int sizing, int max_chunks, int queued) {
+    if (sizing == FRAME_SIZING_FIXED) {
+        return max_chunks;
+    }
+    int chunks = 1 + queued / FRAME_AUTO_DEPTH;
+    return (chunks < max_chunks) ? chunks : max_chunks;
+}
+
 class Controller {
     public:
         virtual void handleSocksNewConnection(FdPair *fds)        = 0;
@@ -11,6 +31,11 @@ class Controller {
         virtual void handleSocksBridgeDataReady(FdPair *fds)      = 0;
         virtual void handleSocksConnectionTerminated(FdPair *fds) = 0;
         virtual void handleTrafficShapingEvent()                  = 0;
+        /* Tick for the clients of one shard. Controllers that are not
+         * sharded handle every client on each tick. */
+        virtual void handleTrafficShapingEvent(int /*shard*/) {
+            handleTrafficShapingEvent();
+        }
         virtual void handleCliRequest(std::string &request,
                                       std::string &response) = 0;
 
@@ -22,22 +22,20 @@ ControllerClient::ControllerClient(int max_chunks, int chunk_size,
                                    bool ch_active, bool abort_on_conn,
                                    TorPTClient *pt, SocksProxyClient *sp,
                                    TorController *tc, CliUnixServer *cli,
-                                   TrafficShaper *ts)
+                                   TrafficShaper *ts, int frame_sizing)
     : _max_chunks(max_chunks), _chunk_size(chunk_size), _ts_min_rate(ts_min_rate),
       _ts_max_rate(ts_max_rate), _k_min(k_min), _ch_active_startup(ch_active),
-      _abort_on_conn(abort_on_conn), _frame_pool(20, max_chunks, chunk_size),
-      _chaff_frame(1, chunk_size)
+      _abort_on_conn(abort_on_conn), _frame_sizing(frame_sizing),
+      _frame_pool(20, max_chunks, chunk_size),
+      _chaff_ring(chunk_size)
 {
     assert(sp != NULL && cli != NULL && ts != NULL);
+    assert(VALID_FRAME_SIZING(frame_sizing));
     _pt = pt;
     _sp = sp;
     _tc = tc;
     _cli = cli;
     _ts = ts;
-
-    _chaff_frame.setFrameType(FRAME_TYPE_CHAFF);
-    int status = _chaff_frame.setChaffFrameData();
-    assert(status == FRAME_OK);
 }
 
 
@@ -81,20 +79,43 @@ void ControllerClient::handleSocksClientDataReady(FdPair *fdp)
     int nread, space_sz;
     char *din_ptr;
     Frame *frame;
-
-    if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-        #if (LOG_VERBOSE & LOG_BIT_CONN)
-            _sp->log("ClientDataReady: Frame Pool Full!");
-        #endif
-        return;
+    FrameQueue *queue = _client_manager.getDataQueue(fdp);
+    int queued = queue->size();
+
+    //append to the last queued frame while the shaper has not started sending
+    //it, so that small application reads share frames instead of padding one
+    //each
+    bool append = false;
+    frame = queue->back();
+    if (frame != nullptr && frame->beginAppend()) {
+        stat += frame->getDataFrameTail(din_ptr, space_sz,
+            frame_sizing_chunks(_frame_sizing, _max_chunks, queued - 1));
+        append = (space_sz > 0);
+        if (!append) {
+            frame->endAppend(true);
+        }
     }
 
-    frame->setFrameType(FRAME_TYPE_DATA);
-    stat += frame->getDataFrameSpace(din_ptr, space_sz);
+    if (!append) {
+        if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
+            #if (LOG_VERBOSE & LOG_BIT_CONN)
+                _sp->log("ClientDataReady: Frame Pool Full!");
+            #endif
+            return;
+        }
+
+        frame->setFrameType(FRAME_TYPE_DATA);
+        stat += frame->getDataFrameSpace(din_ptr, space_sz,
+            frame_sizing_chunks(_frame_sizing, _max_chunks, queued));
+    }
 
     nread = _sp->read_msg_client(fdp, din_ptr, space_sz);
     if (nread <= 0) {
-        _frame_pool.unallocFrame(frame);
+        if (append) {
+            frame->endAppend(false);
+        } else {
+            _frame_pool.unallocFrame(frame);
+        }
         #if (LOG_VERBOSE & LOG_BIT_CONN)
             _sp->log("ClientDataReady: Client closed!");
         #endif
@@ -106,15 +127,27 @@ void ControllerClient::handleSocksClientDataReady(FdPair *fdp)
         _stats.add_tor_bytes_rec(nread);
     #endif
 
-    stat += frame->setDataFrameSize(nread);
-    assert(stat == FRAME_OK);
-
     #if (LOG_VERBOSE & LOG_BIT_CONN)
         _sp->log("Read from client bytes (%d)", nread);
     #endif
 
+    if (append) {
+        char *data_ptr; int data_sz;
+        stat += frame->getDataFrameData(data_ptr, data_sz);
+        stat += frame->setDataFrameSize(data_sz + nread);
+        assert(stat == FRAME_OK);
+        frame->endAppend(nread == space_sz);
+        return;
+    }
+
+    stat += frame->setDataFrameSize(nread);
+    assert(stat == FRAME_OK);
+    if (nread < space_sz) {
+        frame->unseal();
+    }
+
     //if (_client_manager.getClientState(fdp) != CLIENT_STATE_INACTIVE) {
-        _client_manager.getDataQueue(fdp)->push(frame);
+        queue->push(frame);
 
     /*}
     else {
@@ -155,70 +188,31 @@ void ControllerClient::handleSocksBridgeDataReady(FdPair *fdp)
 {
     int nread, nwrite, status;
     Frame *frame;
-    char *din_ptr; int din_sz, chunk, total_chunks = 1;
-    bool ssl_try = false;
+    char *din_ptr; int din_sz;
     FrameControlFields fcf;
 
-    #if USE_SSL
-        chunk = _client_manager.getTmpChunk(fdp);
-
-        if (chunk == -1) {
-            if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-                #if (LOG_VERBOSE & LOG_BIT_CONN)
-                    _sp->log("BridgeDataReady: Frame Pool Full!");
-                #endif
-                return;
-            }
-            chunk = 0;
-        } else {
-            ssl_try = true;
-            frame = _client_manager.getTmpFrame(fdp);
-            assert(frame != nullptr);
-            if (chunk > 0)
-                total_chunks = frame->getNumChunks();
-        }
-    #else
-        if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-            #if (LOG_VERBOSE & LOG_BIT_CONN)
-                _sp->log("ClientDataReady: Frame Pool Full!");
-            #endif
-            return;
-        }
-        chunk = 0;
-    #endif
-
-    for (; chunk < total_chunks; chunk++)
-    {
-        frame->probeChunk(chunk, din_ptr, din_sz);
+    if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
+        #if (LOG_VERBOSE & LOG_BIT_CONN)
+            _sp->log("BridgeDataReady: Frame Pool Full!");
+        #endif
+        return;
+    }
 
-        nread = _sp->readn_msg_bridge(fdp, din_ptr, din_sz);
-        if (nread <= 0) {
+    //read a complete frame, partial frames stay buffered by the proxy
+    frame->probeChunk(0, din_ptr, din_sz);
+    nread = _sp->readframe_msg_bridge(fdp, din_ptr, din_sz, _max_chunks);
+    if (nread <= 0) {
+        if (nread != SSL_TRY_LATER) {
             #if (LOG_VERBOSE & LOG_BIT_CONN)
                 _sp->log("BridgeDataReady: Bridge closed!");
             #endif
-            if (nread != SSL_TRY_LATER) {
-                _sp->shutdown_connection(fdp);
-                status = _frame_pool.unallocFrame(frame);
-                assert(status == FRAME_POOL_OK);
-            } else {
-                _client_manager.setTmpFrame(fdp, frame);
-                _client_manager.setTmpChunk(fdp, chunk);
-            }
-            return;
-        }
-        assert(nread == din_sz);
-
-        if (chunk == 0) {
-            total_chunks = frame->getNumChunks();
-            assert(total_chunks > 0 && total_chunks <= _max_chunks);
+            _sp->shutdown_connection(fdp);
         }
+        status = _frame_pool.unallocFrame(frame);
+        assert(status == FRAME_POOL_OK);
+        return;
     }
-
-    //received complete frame from ssl, so clear tmp frame
-    if (ssl_try) {
-        _client_manager.setTmpChunk(fdp, -1);
-        _client_manager.setTmpFrame(fdp, nullptr);
-    }
+    assert(nread == frame->getNumChunks() * din_sz);
 
     switch (frame->getFrameType()) {
         case FRAME_TYPE_DATA: break;
@@ -359,7 +353,7 @@ void ControllerClient::handleSocksConnectionTerminated(FdPair *fdp)
                 fdp->get_fd0(), fdp->get_fd1());
     #endif
 
-    _client_manager.remove_client(fdp, &_frame_pool);
+    _client_manager.remove_client(fdp, &_frame_pool, &_chaff_ring);
 
     if (_abort_on_conn)
         abort();
@@ -600,6 +594,31 @@ void ControllerClient::handleCliRequest(std::string &request, std::string &respo
         return;
     }
 
+    if (cmd == "stats_ts") {
+        for (int shard = 0; shard < _ts->getShards(); shard++) {
+            TrafficShaperStats stats = _ts->getStats(shard);
+            long ticks = (stats._ticks == 0) ? 1 : stats._ticks;
+
+            response += (boost::format("%d\t%ld\t%.1f\t%.1f\t%.1f\t%ld\t%ld\t%ld\t%ld\n")
+                    % shard
+                    % stats._ticks
+                    % (stats._interval_sum / ticks)
+                    % (stats._target_sum / ticks)
+                    % (stats._error_sum / ticks)
+                    % stats._interval_min
+                    % stats._interval_max
+                    % stats._overruns
+                    % stats._skipped).str();
+        }
+        return;
+    }
+
+    if (cmd == "stats_ts_clear") {
+        _ts->clearStats();
+        response = "OK\n";
+        return;
+    }
+
     #if STATS
         if (cmd == "stats_bytes") {
             Client *client = _client_manager.getClientInstance();
@@ -788,126 +807,153 @@ void ControllerClient::handleCliRequest(std::string &request, std::string &respo
 
 void ControllerClient::handleTrafficShapingEvent()
 {
-    _client_manager.safeIterate([this](FdPair* fdp, Client* client) {
-        FrameQueue* ctrl_frame_queue = client->getCtrlQueue();
-        FrameQueue* data_frame_queue = client->getDataQueue();
-        Frame* frame_to_send;
-        int status, nwrite, chunk_sz, chunk;
-        char* chunk_ptr;
-
-        /* does last SSL write returned SSL_WANT_WRITE?
-        If yes, resume frame type. */
-        int ssl_partial_frame = client->getWRTmpFrameType();
+    int burst = _ts->getBurst();
 
-        bool partial_data_frame = !data_frame_queue->empty() && data_frame_queue->getLastChunk() > 0;
+    _client_manager.safeIterate([this, burst](FdPair* fdp, Client* client) {
+        //the same number of chunks every tick, chaff filling the gaps
+        for (int i = 0; i < burst; i++) {
+            if (send_chunk(fdp, client) <= 0) {
+                break;
+            }
+        }
+    });
+}
 
-        if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_CTRL) &&
-            (!partial_data_frame && !ctrl_frame_queue->empty())) {
-            frame_to_send = ctrl_frame_queue->getFrame();
+/* Sends the next chunk to the bridge: ctrl frames first, then data, else chaff */
+int ControllerClient::send_chunk(FdPair* fdp, Client* client)
+{
+    FrameQueue* ctrl_frame_queue = client->getCtrlQueue();
+    FrameQueue* data_frame_queue = client->getDataQueue();
+    Frame* frame_to_send;
+    int status, nwrite, chunk_sz, chunk;
+    char* chunk_ptr;
 
-            status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
+    /* does last SSL write returned SSL_WANT_WRITE?
+    If yes, resume frame type. */
+    int ssl_partial_frame = client->getWRTmpFrameType();
 
-            #if DEBUG_TOOLS
-                nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
-                    chunk_sz), DT_DROP_CTRL, _debug_info, chunk_sz);
-            #else
-                nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
-            #endif
+    bool partial_data_frame = !data_frame_queue->empty() && data_frame_queue->getLastChunk() > 0;
 
-            if (nwrite != SSL_TRY_LATER) {
-                ctrl_frame_queue->pop();
-                #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                    _sp->log("Popped from ctrl queue. Left %d ", ctrl_frame_queue->size());
-                #endif
-                _frame_pool.unallocFrame(frame_to_send);
-            } else {
-                client->setWRTmpFrameType(FRAME_TYPE_CTRL);
-            }
+    if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_CTRL) &&
+        (!partial_data_frame && !ctrl_frame_queue->empty())) {
+        frame_to_send = ctrl_frame_queue->getFrame();
 
-            #if STATS
-                if (nwrite > 0) {
-                    _stats.add_no_data_bytes_sent(nwrite);
-                }
-            #endif
+        status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
 
-        } else if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_DATA) &&
-                (!data_frame_queue->empty() && client->getState() == CLIENT_STATE_ACTIVE)) {
-            frame_to_send = data_frame_queue->getFrame();
-            chunk = data_frame_queue->getLastChunk();
+        #if DEBUG_TOOLS
+            nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
+                chunk_sz), DT_DROP_CTRL, _debug_info, chunk_sz);
+        #else
+            nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
+        #endif
 
+        if (nwrite != SSL_TRY_LATER) {
+            ctrl_frame_queue->pop();
             #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                _sp->log("Got frame from data queue.");
+                _sp->log("Popped from ctrl queue. Left %d ", ctrl_frame_queue->size());
             #endif
+            _frame_pool.unallocFrame(frame_to_send);
+        } else {
+            client->setWRTmpFrameType(FRAME_TYPE_CTRL);
+        }
 
-            status = frame_to_send->probeChunk(chunk, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
+        #if STATS
+            if (nwrite > 0) {
+                _stats.add_no_data_bytes_sent(nwrite);
+            }
+        #endif
 
-            #if DEBUG_TOOLS
-                nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
-                    chunk_sz), DT_DROP_DATA, _debug_info, chunk_sz);
-            #else
-                nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
-            #endif
+    } else if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_DATA) &&
+            (!data_frame_queue->empty() && client->getState() == CLIENT_STATE_ACTIVE) &&
+            data_frame_queue->getFrame()->seal()) {
+        frame_to_send = data_frame_queue->getFrame();
+        chunk = data_frame_queue->getLastChunk();
 
-            if (nwrite != SSL_TRY_LATER) {
-                if (chunk + 1 < frame_to_send->getNumChunks()) {
-                    data_frame_queue->setLastChunk(chunk + 1);
-                } else {
-                    #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                        _sp->log("Popped from data queue. Left %d ", data_frame_queue->size());
-                    #endif
-                    data_frame_queue->pop();
-
-                    #if STATS
-                        if (nwrite > 0) {
-                            char* data_ptr; int data_sz;
-                            status = frame_to_send->getDataFrameData(data_ptr, data_sz);
-                            assert(status == FRAME_OK);
-                            _stats.add_bytes_sent(data_sz);
-                        }
-                    #endif
+        #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+            _sp->log("Got frame from data queue.");
+        #endif
 
-                    _frame_pool.unallocFrame(frame_to_send);
-                }
+        status = frame_to_send->probeChunk(chunk, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
+
+        #if DEBUG_TOOLS
+            nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
+                chunk_sz), DT_DROP_DATA, _debug_info, chunk_sz);
+        #else
+            nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
+        #endif
+
+        if (nwrite != SSL_TRY_LATER) {
+            if (chunk + 1 < frame_to_send->getNumChunks()) {
+                data_frame_queue->setLastChunk(chunk + 1);
             } else {
-                client->setWRTmpFrameType(FRAME_TYPE_DATA);
-            }
+                #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+                    _sp->log("Popped from data queue. Left %d ", data_frame_queue->size());
+                #endif
+                data_frame_queue->pop();
 
+                #if STATS
+                    if (nwrite > 0) {
+                        char* data_ptr; int data_sz;
+                        status = frame_to_send->getDataFrameData(data_ptr, data_sz);
+                        assert(status == FRAME_OK);
+                        _stats.add_bytes_sent(data_sz);
+                    }
+                #endif
 
+                _frame_pool.unallocFrame(frame_to_send);
+            }
         } else {
-            frame_to_send = &_chaff_frame;
+            client->setWRTmpFrameType(FRAME_TYPE_DATA);
+        }
 
-            status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
 
-            #if DEBUG_TOOLS
-                nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
-                    chunk_sz), DT_DROP_CHAFF, _debug_info, chunk_sz);
-            #else
-                nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
-            #endif
+    } else {
+        //a pending write resumes with the chaff frame it started with
+        int chaff_slot = (ssl_partial_frame == FRAME_TYPE_CHAFF) ?
+                         client->getWRTmpChaff() : _chaff_ring.acquire();
+        frame_to_send = _chaff_ring.getFrame(chaff_slot);
 
-            if (nwrite == SSL_TRY_LATER) {
-                client->setWRTmpFrameType(FRAME_TYPE_CHAFF);
-            }
+        status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
 
-            #if STATS
-                if (nwrite > 0) {
-                    _stats.add_no_data_bytes_sent(nwrite);
-                }
-            #endif
-        }
+        #if DEBUG_TOOLS
+            nwrite = DT_CONTROL(_sp->writen_msg_bridge(fdp, chunk_ptr,
+                chunk_sz), DT_DROP_CHAFF, _debug_info, chunk_sz);
+        #else
+            nwrite = _sp->writen_msg_bridge(fdp, chunk_ptr, chunk_sz);
+        #endif
 
-        if (nwrite <= 0) {
-            #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                _sp->log("Failed to send!");
-            #endif
+        if (nwrite == SSL_TRY_LATER) {
+            client->setWRTmpFrameType(FRAME_TYPE_CHAFF);
+            client->setWRTmpChaff(chaff_slot);
+        } else {
+            client->setWRTmpChaff(-1);
+            _chaff_ring.release(chaff_slot);
         }
-        else {
-            assert(nwrite == chunk_sz);
+
+        #if STATS
+            if (nwrite > 0) {
+                _stats.add_no_data_bytes_sent(nwrite);
+            }
+        #endif
+    }
+
+    if (nwrite <= 0) {
+        #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+            _sp->log("Failed to send!");
+        #endif
+    }
+    else {
+        assert(nwrite == chunk_sz);
+
+        if (ssl_partial_frame != -1) {
+            client->setWRTmpFrameType(-1);
         }
-    });
+    }
+
+    return nwrite;
 }
 
 /* ======================= CTRL Frames Handlers ======================= */
@@ -1360,8 +1406,6 @@ int ControllerClient::shutdown_local_helper(FdPair *fdp, int circ_val) {
     assert(fdp != nullptr && circ_val < 0);
 
     int status;
-    FrameQueue* data_queue = _client_manager.getDataQueue(fdp);
-    Frame* frame;
 
     _circ = circ_val;
     _circ_state = CIRC_STATE_UNDEF;
@@ -1373,11 +1417,7 @@ int ControllerClient::shutdown_local_helper(FdPair *fdp, int circ_val) {
 
     status = _sp->shutdown_local_connection(fdp);
 
-    while (!data_queue->empty()) {
-        frame = data_queue->getFrame();
-        data_queue->pop();
-        _frame_pool.unallocFrame(frame);
-    }
+    _client_manager.unallocDataFrames(fdp, &_frame_pool);
 
     #if (LOG_VERBOSE & LOG_BIT_CTRL_LOCK)
         _sp->log("Shutdown local connection: bridge %d", fdp->get_fd1());
@@ -3,6 +3,7 @@
 
 #include "TrafficShaper.hh"
 #include "FramePool.hh"
+#include "ChaffRing.hh"
 #include "ClientManager.hh"
 
 class TorPTClient;
@@ -27,7 +28,8 @@ public:
     ControllerClient(int max_chunks, int chunk_size, int ts_min_rate,
                      int ts_max_rate, int k_min, bool ch_active, bool abort_on_conn,
                      TorPTClient *pt, SocksProxyClient *sp, TorController *tc,
-                     CliUnixServer *cli, TrafficShaper *ts);
+                     CliUnixServer *cli, TrafficShaper *ts,
+                     int frame_sizing = FRAME_SIZING_FIXED);
 
     ~ControllerClient(){};
 
@@ -88,6 +90,8 @@ protected:
 
     int shutdown_local_helper(FdPair *fdp, int circ_val);
 
+    int send_chunk(FdPair *fdp, Client *client);
+
     int _socks_port = -1;
 
     int _torctl_port = -1;
@@ -110,9 +114,12 @@ protected:
     int _k_min;
     bool _ch_active_startup;
     bool _abort_on_conn;
+    int _frame_sizing;
 
     FramePool _frame_pool;
-    Frame _chaff_frame;
+
+    /* Fresh chaff frames, refilled off the traffic shaper tick */
+    ChaffRing _chaff_ring;
 
     TrafficShaper *_ts;
 
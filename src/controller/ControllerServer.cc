@@ -22,20 +22,110 @@
 ControllerServer::ControllerServer(int max_chunks, int chunk_size,
                                    int ts_min_rate, int ts_max_rate,
                                    TorPTServer *pt, SocksProxyServer *sp,
-                                   CliUnixServer *cli, TrafficShaper *ts)
+                                   CliUnixServer *cli, TrafficShaper *ts,
+                                   int shards, int tick_workers,
+                                   int rate_control, int groups, int group_by,
+                                   int frame_sizing, bool prestage)
     : _max_chunks(max_chunks), _chunk_size(chunk_size), _ts_min_rate(ts_min_rate),
-      _ts_max_rate(ts_max_rate), _frame_pool(20, max_chunks, chunk_size),
-      _chaff_frame(1, chunk_size)
+      _ts_max_rate(ts_max_rate), _frame_sizing(frame_sizing),
+      _chaff_ring(chunk_size),
+      _client_manager(shards, groups), _tick_workers(tick_workers),
+      _prestage(prestage), _stop_stagers(false), _staged_ticks(0),
+      _inline_ticks(0), _deferred_ticks(0), _group_by(group_by), _rate_pending(false),
+      _rate_updates_coalesced(0), _ts_rate_frames_suppressed(0),
+      _quota_pauses(0), _coalesced_reads(0)
 {
     assert(pt != NULL && sp != NULL && cli != NULL && ts != NULL);
+    assert(shards > 0);
+    assert(tick_workers >= 0);
+    if (tick_workers > 0) {
+        _tick_pool.initialize(tick_workers);
+    }
+
+    assert(TS_VALID_RATE_CONTROL(rate_control));
+    assert(VALID_FRAME_SIZING(frame_sizing));
+    assert(groups > 0 && groups <= MAX_GROUPS && VALID_GROUP_BY(group_by));
+    for (int group = 0; group < groups; group++) {
+        AnonymityGroup *g = new AnonymityGroup();
+        if (rate_control == TS_RATE_CONTROL_LINEAR) {
+            g->_rate_controller = new LinearRateController(ts_min_rate, ts_max_rate);
+        } else {
+            g->_rate_controller = new AdaptiveRateController(ts_min_rate, ts_max_rate);
+        }
+        _groups.push_back(g);
+    }
+    _group_credit.assign(shards, std::vector<long>(groups, 0));
+    _group_due.assign(shards, std::vector<char>(groups, 1));
+    _next_rate_update = std::chrono::steady_clock::now();
+
+    for (int shard = 0; shard < shards; shard++) {
+        _frame_pools.push_back(new FramePool(20, max_chunks, chunk_size));
+    }
     _pt = pt;
     _sp = sp;
     _cli = cli;
     _ts = ts;
 
-    _chaff_frame.setFrameType(FRAME_TYPE_CHAFF);
-    int status = _chaff_frame.setChaffFrameData();
-    assert(status == FRAME_OK);
+    if (prestage) {
+        for (int shard = 0; shard < shards; shard++) {
+            _stagers.push_back(new ShardStager());
+        }
+    }
+}
+
+ControllerServer::~ControllerServer()
+{
+    for (ShardStager *stager : _stagers) {
+        {
+            std::unique_lock<std::mutex> stage_lock(stager->_mtx);
+            _stop_stagers = true;
+        }
+        stager->_cv.notify_one();
+        if (stager->_thread.joinable()) {
+            stager->_thread.join();
+        }
+        delete stager;
+    }
+    for (AnonymityGroup *g : _groups) {
+        delete g->_rate_controller;
+        delete g;
+    }
+    for (FramePool *pool : _frame_pools) {
+        delete pool;
+    }
+}
+
+FramePool* ControllerServer::frame_pool(FdPair *fdp)
+{
+    assert(fdp->getShard() >= 0 && fdp->getShard() < (int) _frame_pools.size());
+    return _frame_pools[fdp->getShard()];
+}
+
+int ControllerServer::getNumAllocFrames()
+{
+    int total = 0;
+    for (FramePool *pool : _frame_pools) {
+        total += pool->getNumAllocFrames();
+    }
+    return total;
+}
+
+int ControllerServer::getNumUnallocFrames()
+{
+    int total = 0;
+    for (FramePool *pool : _frame_pools) {
+        total += pool->getNumUnallocFrames();
+    }
+    return total;
+}
+
+int ControllerServer::getFramePoolSize()
+{
+    int total = 0;
+    for (FramePool *pool : _frame_pools) {
+        total += pool->size();
+    }
+    return total;
 }
 
 
@@ -46,9 +136,11 @@ void ControllerServer::handleSocksNewConnection(FdPair *fdp)
                 fdp->get_fd0(), fdp->get_fd1());
     #endif
 
+    std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
+
     _client_manager.add_client(fdp);
 
-    ts_rate_update();
+    ts_rate_schedule(fdp);
 
     //wake up traffic shaper, there are at least one client
     if (_client_manager.size() == 1) {
@@ -60,77 +152,42 @@ void ControllerServer::handleSocksClientDataReady(FdPair *fdp)
 {
     int nread, nwrite, status;
     Frame *frame;
-    char *din_ptr; int din_sz, chunk, total_chunks = 1;
-    bool ssl_try = false;
+    char *din_ptr; int din_sz;
     FrameControlFields fcf;
 
-    #if DATA_FRAMES_SYNC_DLV
-        FrameQueue *reception_queue;
-    #else
+    #if !DATA_FRAMES_SYNC_DLV
         char *dout_ptr; int dout_sz;
     #endif
 
-    #if USE_SSL
-        chunk = _client_manager.getTmpChunk(fdp);
-
-        if (chunk == -1) {
-            if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-                #if (LOG_VERBOSE & LOG_BIT_CONN)
-                    _sp->log("ClientDataReady: Frame Pool Full!");
-                #endif
-                return;
-            }
-            chunk = 0;
-        } else {
-            ssl_try = true;
-            frame = _client_manager.getTmpFrame(fdp);
-            assert(frame != nullptr);
-
-            if (chunk > 0)
-                total_chunks = frame->getNumChunks();
-        }
-    #else
-        if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-            #if (LOG_VERBOSE & LOG_BIT_CONN)
-                _sp->log("ClientDataReady: Frame Pool Full!");
-            #endif
-            return;
-        }
-        chunk = 0;
-    #endif
-
-    //read all chunks from the frame
-    //when reading the first chunk, get the number of chunks
-    for (; chunk < total_chunks; chunk++) {
-        frame->probeChunk(chunk, din_ptr, din_sz);
-
-        nread = _sp->readn_msg_client(fdp, din_ptr, din_sz);
-        if (nread <= 0) {
-            if (nread != SSL_TRY_LATER) {
-                _sp->shutdown_connection(fdp);
-                status = _frame_pool.unallocFrame(frame);
-                assert(status == FRAME_POOL_OK);
-            } else {
-                _client_manager.setTmpFrame(fdp, frame);
-                _client_manager.setTmpChunk(fdp, chunk);
-            }
-            return;
-        }
-        assert(nread == din_sz);
+    //leave the frames in the socket until the tick or a delivery frees frames
+    //of the shard, the reactor would otherwise keep retrying
+    if (frame_pool(fdp)->allocFrame(frame) == FRAME_POOL_ERR_FULL) {
+        #if (LOG_VERBOSE & LOG_BIT_CONN)
+            _sp->log("ClientDataReady: Frame Pool Full!");
+        #endif
+        fdp->setReadable(FDPAIR_END_CLIENT, false);
+        fdp->setPoolPaused(true);
+        _quota_pauses.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
 
-        if (chunk == 0) {
-            total_chunks = frame->getNumChunks();
-            assert(total_chunks > 0 && total_chunks <= _max_chunks);
+    //read a complete frame, partial frames stay buffered by the proxy
+    frame->probeChunk(0, din_ptr, din_sz);
+    nread = _sp->readframe_msg_client(fdp, din_ptr, din_sz, _max_chunks);
+    if (nread <= 0) {
+        if (nread != SSL_TRY_LATER) {
+            _sp->shutdown_connection(fdp);
         }
+        status = frame_pool(fdp)->unallocFrame(frame);
+        assert(status == FRAME_POOL_OK);
+        return;
     }
+    assert(nread == frame->getNumChunks() * din_sz);
 
-    //received complete frame from ssl, so clear tmp frame
-    if (ssl_try) {
-        _client_manager.setTmpChunk(fdp, -1);
-        _client_manager.setTmpFrame(fdp, nullptr);
-    }
+    //DATA frames may be delivered, and freed, by another shard once queued
+    int frame_type = frame->getFrameType();
 
-    switch (frame->getFrameType()) {
+    switch (frame_type) {
         case FRAME_TYPE_CHAFF:
             _client_manager.setReceptionMark(fdp);
 
@@ -153,8 +210,7 @@ void ControllerServer::handleSocksClientDataReady(FdPair *fdp)
         #endif
 
         #if DATA_FRAMES_SYNC_DLV
-            reception_queue = _client_manager.getReceptionQueue(fdp);
-            reception_queue->push(frame);
+            _client_manager.pushReceptionFrame(fdp, frame);
 
         #else
             status = frame->getDataFrameData(dout_ptr, dout_sz);
@@ -181,7 +237,10 @@ void ControllerServer::handleSocksClientDataReady(FdPair *fdp)
         #endif
         break;
 
-        case FRAME_TYPE_CTRL:
+        case FRAME_TYPE_CTRL: {
+            //ctrl frames change the state shared by all shards, handle one
+            //at a time
+            std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
             _client_manager.setReceptionMark(fdp);
 
             #if STATS
@@ -228,94 +287,45 @@ void ControllerServer::handleSocksClientDataReady(FdPair *fdp)
                 default                          : handleCtrlFrame_UNKNOWN(fdp);
             }
 
+        }
         break;
 
         default:
             #if (LOG_VERBOSE & LOG_BIT_CONN)
                 _sp->log("Wrong frame type, dropping frame. %d", frame->getFrameType());
             #endif
-            status = _frame_pool.unallocFrame(frame);
+            status = frame_pool(fdp)->unallocFrame(frame);
             assert(status == FRAME_OK);
         return;
     }
 
     /* Check for pending data messages, now that I've received one frame */
     #if DATA_FRAMES_SYNC_DLV
-        bool have_recpt_frames = _client_manager.handleReceptionFrames([this]
-                                (FdPair *fdp, Client *client) {
-
-            int status, nwrite;
-            Frame *frame;
-            char *dout_ptr; int dout_sz;
-
-            status = client->getReceivedFrame(frame);
-            assert(status != RECP_NO_FRAME_AVAIL);
-
-            if (status == RECP_DATA_FRAME) {
-
-                status = frame->getDataFrameData(dout_ptr, dout_sz);
-                assert(status == FRAME_OK);
-
-                //only delivery client frame to Tor if restriction holds
-                //otherwise drop frame since client is about to be informed
-                if (client->getState() == CLIENT_STATE_ACTIVE) {
-                    nwrite = _sp->writen_msg_local(fdp, dout_ptr, dout_sz);
-
-                    #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
-                        _sp->log("Delivered DATA frame to client %d", fdp->get_fd0());
-                    #endif
-
-                    if (nwrite <= 0) {
-                        _sp->shutdown_connection(fdp);
-                    }
-                    else {
-                        assert(nwrite == dout_sz);
-
-                        #if (LOG_VERBOSE & LOG_BIT_CONN)
-                        _sp->log("Wrote (%d) to client (%d), actually (%d)",
-                                dout_sz, fdp->get_fd0(), nwrite);
-                        #endif
-
-                        #if STATS
-                            _stats.add_tor_bytes_sent(dout_sz);
-                        #endif
-                    }
-
-                }
-                #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
-                else {
-                    _sp->log("Dropped frame from client %d since client is %d!",
-                            fdp->get_fd0(), client->getState());
-                }
-                #endif
-
-                status = _frame_pool.unallocFrame(frame);
-                assert(status == FRAME_OK);
-            }
-
-            client->clearReceivedFrame();
-        });
+        bool have_recpt_frames = _client_manager.handleReceptionFrames(
+            _client_manager.getClientGroup(fdp), SYNC_DLV_MAX_ROUNDS, [this](FdPair *fdp, Client *client, int rounds) {
+                deliver_receptions(fdp, client, rounds);
+            }) > 0;
 
         #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
-            if (frame->getFrameType() == FRAME_TYPE_DATA && !have_recpt_frames) {
+            if (frame_type == FRAME_TYPE_DATA && !have_recpt_frames) {
                 _sp->log("Delaying delivering DATA frames since I do not \
 receive a frame from at least one client.");
             }
         #endif
 
         #if SYNC_DLV_STATS
-            if (frame->getFrameType() == FRAME_TYPE_DATA && !have_recpt_frames) {
+            if (frame_type == FRAME_TYPE_DATA && !have_recpt_frames) {
                 _dlv_stats.updateRetainedFrames();
             }
         #endif
 
-        if (frame->getFrameType() != FRAME_TYPE_DATA) {
-            status = _frame_pool.unallocFrame(frame);
+        if (frame_type != FRAME_TYPE_DATA) {
+            status = frame_pool(fdp)->unallocFrame(frame);
             assert(status == FRAME_OK);
         }
 
     #else
-        status = _frame_pool.unallocFrame(frame);
+        status = frame_pool(fdp)->unallocFrame(frame);
         assert(status == FRAME_OK);
 
     #endif
@@ -327,20 +337,52 @@ void ControllerServer::handleSocksBridgeDataReady(FdPair *fdp)
     int nread, stat = 0;
     char *din_ptr; int space_sz;
     Frame *frame;
-
-    if (_frame_pool.allocFrame(frame) == FRAME_POOL_ERR_FULL) {
-        #if (LOG_VERBOSE & LOG_BIT_CONN)
-            _sp->log("ClientDataReady: Frame Pool Full!");
-        #endif
-        return;
+    FrameQueue *queue = _client_manager.getDataQueue(fdp);
+    int queued = queue->size();
+
+    //append to the last queued frame while the shaper has not started sending
+    //it, so that small Tor reads share frames instead of padding one each
+    bool append = false;
+    frame = queue->back();
+    if (frame != nullptr && frame->beginAppend()) {
+        stat += frame->getDataFrameTail(din_ptr, space_sz,
+            frame_sizing_chunks(_frame_sizing, _max_chunks, queued - 1));
+        append = (space_sz > 0);
+        if (!append) {
+            frame->endAppend(true);
+        }
     }
 
-    frame->setFrameType(FRAME_TYPE_DATA);
-    stat += frame->getDataFrameSpace(din_ptr, space_sz);
+    if (!append) {
+        //leave the data in the socket until the shaper drains the queue of the
+        //client, so that one Tor stream cannot take the pool of everyone
+        if (queued >= CLIENT_DATA_HIGH_WATER ||
+            frame_pool(fdp)->allocFrame(frame) == FRAME_POOL_ERR_FULL) {
+            #if (LOG_VERBOSE & LOG_BIT_CONN)
+                _sp->log("BridgeDataReady: client %d over quota, pausing reads",
+                         fdp->get_fd0());
+            #endif
+            fdp->setOverQuota(true);
+            fdp->setReadable(FDPAIR_END_LOCAL, false);
+            _quota_pauses.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        frame->setFrameType(FRAME_TYPE_DATA);
+        stat += frame->getDataFrameSpace(din_ptr, space_sz,
+            frame_sizing_chunks(_frame_sizing, _max_chunks, queued));
+    }
 
     nread = _sp->read_msg_local(fdp, din_ptr, space_sz);
     if (nread <= 0) {
-        _frame_pool.unallocFrame(frame);
+        if (append) {
+            frame->endAppend(false);
+        } else {
+            frame_pool(fdp)->unallocFrame(frame);
+        }
+        if (nread == SSL_TRY_LATER) {
+            return;
+        }
         #if (LOG_VERBOSE & LOG_BIT_CONN)
             _sp->log("Local closed! %d err: %d", nread, errno);
         #endif
@@ -349,8 +391,6 @@ void ControllerServer::handleSocksBridgeDataReady(FdPair *fdp)
         _sp->shutdown_local_connection(fdp);
         return;
     }
-    stat += frame->setDataFrameSize(nread);
-    assert(stat == FRAME_OK);
 
     #if (LOG_VERBOSE & LOG_BIT_CONN)
         _sp->log("Read from local num bytes (%d)", nread);
@@ -360,18 +400,22 @@ void ControllerServer::handleSocksBridgeDataReady(FdPair *fdp)
         _stats.add_tor_bytes_rec(nread);
     #endif
 
-    //if (_client_manager.getClientState(fdp) != CLIENT_STATE_INACTIVE) {
-        FrameQueue* queue = _client_manager.getDataQueue(fdp);
-        queue->push(frame);
-    /*}
-    else {
-        _frame_pool.unallocFrame(frame);
+    if (append) {
+        char *data_ptr; int data_sz;
+        stat += frame->getDataFrameData(data_ptr, data_sz);
+        stat += frame->setDataFrameSize(data_sz + nread);
+        assert(stat == FRAME_OK);
+        frame->endAppend(nread == space_sz);
+        _coalesced_reads.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
 
-        #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
-            _sp->log("Dropped frame from local to client %d since client IS NOT ACTIVE!",
-                fdp->get_fd0());
-        #endif
-    }*/
+    stat += frame->setDataFrameSize(nread);
+    assert(stat == FRAME_OK);
+    if (nread < space_sz) {
+        frame->unseal();
+    }
+    queue->push(frame);
 }
 
 
@@ -382,19 +426,22 @@ void ControllerServer::handleSocksConnectionTerminated(FdPair *fdp)
                 fdp->get_fd0(), fdp->get_fd1());
     #endif
 
-    _client_manager.remove_client(fdp, &_frame_pool);
+    std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
+
+    int group = _client_manager.getClientGroup(fdp);
+    _client_manager.remove_client(fdp, frame_pool(fdp), &_chaff_ring);
 
     //idle traffic shaper, no clients are connected no need to run handler
     if (_client_manager.empty()) {
         _ts->idle();
     } else {
         //order WAIT for active clients whose restriction is broken
-        order_WAIT();
+        order_WAIT(group);
 
         //order CHANGE for active clients
-        order_CHANGE();
+        order_CHANGE(group);
 
-        ts_rate_update();
+        ts_rate_schedule();
     }
 }
 
@@ -425,9 +472,9 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
 
     if (cmd == "stats_fp") {
         response = (boost::format("%d\t%d\t%d\n")
-                % _frame_pool.getNumAllocFrames()
-                % _frame_pool.getNumUnallocFrames()
-                % _frame_pool.size()).str();
+                % getNumAllocFrames()
+                % getNumUnallocFrames()
+                % getFramePoolSize()).str();
 
     } else if (cmd == "stats_clients") {
         response = (boost::format("%d / %d\t%d\t%d\t%d\n")
@@ -445,11 +492,81 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
         if (params.size() != 2) {
             response = "Invalid value\nUsage: ts_rate <TS RATE>\n";
         } else {
-            order_TS_RATE(std::stoi(params[1]));
+            std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
+            for (int group = 0; group < (int) _groups.size(); group++) {
+                order_TS_RATE(group, std::stoi(params[1]));
+            }
 
             response = "OK\n";
         }
 
+    } else if (cmd == "stats_rate") {
+        std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
+        for (AnonymityGroup *g : _groups) {
+            response += (boost::format("%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n")
+                    % g->_ts_rate
+                    % g->_rate_sample._clients
+                    % g->_rate_sample._data_frames
+                    % g->_rate_sample._chunks
+                    % g->_rate_sample._chaff_chunks
+                    % g->_rate_sample._ticks
+                    % g->_rate_sample._overruns
+                    % _rate_updates_coalesced
+                    % _ts_rate_frames_suppressed).str();
+        }
+    } else if (cmd == "stats_groups") {
+        std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx);
+        for (int group = 0; group < (int) _groups.size(); group++) {
+            response += (boost::format("%d\t%d / %d\t%d\n")
+                    % group
+                    % _client_manager.getNumberClients(group)
+                    % _client_manager.getGroupSize(group)
+                    % _groups[group]->_ts_rate).str();
+        }
+    } else if (cmd == "stats_ts") {
+        for (int shard = 0; shard < _ts->getShards(); shard++) {
+            TrafficShaperStats stats = _ts->getStats(shard);
+            long ticks = (stats._ticks == 0) ? 1 : stats._ticks;
+
+            response += (boost::format("%d\t%ld\t%.1f\t%.1f\t%.1f\t%ld\t%ld\t%ld\t%ld\n")
+                    % shard
+                    % stats._ticks
+                    % (stats._interval_sum / ticks)
+                    % (stats._target_sum / ticks)
+                    % (stats._error_sum / ticks)
+                    % stats._interval_min
+                    % stats._interval_max
+                    % stats._overruns
+                    % stats._skipped).str();
+        }
+    } else if (cmd == "stats_ts_clear") {
+        _ts->clearStats();
+        response = "OK\n";
+    } else if (cmd == "stats_quota") {
+        int over_quota = 0;
+        _client_manager.safeIterate([&over_quota](FdPair *fdp, Client *client) {
+            over_quota += fdp->isOverQuota() ? 1 : 0;
+        });
+        response = (boost::format("%d\t%ld\n")
+                    % over_quota
+                    % _quota_pauses).str();
+    } else if (cmd == "stats_stage") {
+        response = (boost::format("%ld\t%ld\t%ld\n")
+                    % _staged_ticks
+                    % _inline_ticks
+                    % _deferred_ticks).str();
+    } else if (cmd == "stats_coalesce") {
+        response = (boost::format("%ld\n") % _coalesced_reads).str();
+    } else if (cmd == "stats_chaff") {
+        response = (boost::format("%ld\t%ld\n")
+                    % _chaff_ring.getRefills()
+                    % _chaff_ring.getFallbacks()).str();
+    } else if (cmd == "stats_hs") {
+        response = (boost::format("%d\t%d\t%d\t%d\n")
+                    % _sp->getPendingHandshakes()
+                    % _sp->getCompletedHandshakes()
+                    % _sp->getFailedHandshakes()
+                    % _sp->getExpiredHandshakes()).str();
     }
     #if STATS
         else if (cmd == "stats_bytes") {
@@ -510,9 +627,9 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
             "{\"f_unalloc\": %d}, {\"f_total\": %d}],"
             "\"clients\": %d, \"dataFrames\": %d, \"ctrlFrames\": %d, \"recpFrames\": %d,"
             "\"stats_time\": {\"ctrlTimes\": [%s], \"dataTimes\": [%s], \"chaffTimes\": [%s]}}\n")
-            % _frame_pool.getNumAllocFrames()
-            % _frame_pool.getNumUnallocFrames()
-            % _frame_pool.size()
+            % getNumAllocFrames()
+            % getNumUnallocFrames()
+            % getFramePoolSize()
             % _client_manager.getNumberClients()
             % _client_manager.getTotalDataFrames()
             % _client_manager.getTotalCtrlFrames()
@@ -526,9 +643,9 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
                 "{\"f_unalloc\": %d}, {\"f_total\": %d}], "
                 "\"clients\": %d, \"dataFrames\": %d, \"ctrlFrames\": %d, \"recpFrames\": %d, "
                 "\"ts\": [{\"rate\": %d, \"state\": %d}], \"retained_frames_dlv\": %d, \"data_frames_dlv\": %d}\n")
-                % _frame_pool.getNumAllocFrames()
-                % _frame_pool.getNumUnallocFrames()
-                % _frame_pool.size()
+                % getNumAllocFrames()
+                % getNumUnallocFrames()
+                % getFramePoolSize()
                 % _client_manager.getNumberClients()
                 % _client_manager.getTotalDataFrames()
                 % _client_manager.getTotalCtrlFrames()
@@ -542,9 +659,9 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
                 "{\"f_unalloc\": %d}, {\"f_total\": %d}],"
                 "\"clients\": %d, \"dataFrames\": %d, \"ctrlFrames\": %d, \"recpFrames\": %d, "
                 "\"ts\": [{\"rate\": %d, \"state\": %d}]}\n")
-                % _frame_pool.getNumAllocFrames()
-                % _frame_pool.getNumUnallocFrames()
-                % _frame_pool.size()
+                % getNumAllocFrames()
+                % getNumUnallocFrames()
+                % getFramePoolSize()
                 % _client_manager.getNumberClients()
                 % _client_manager.getTotalDataFrames()
                 % _client_manager.getTotalCtrlFrames()
@@ -561,145 +678,443 @@ void ControllerServer::handleCliRequest(std::string &request, std::string &respo
 
 void ControllerServer::handleTrafficShapingEvent()
 {
-    _client_manager.safeIterate([this](FdPair* fdp, Client* client) {
-        #if TIME_STATS
-            auto start = std::chrono::high_resolution_clock::now();
-            int type;
-        #endif
+    for (int shard = 0; shard < _client_manager.getNumberPartitions(); shard++) {
+        handleTrafficShapingEvent(shard);
+    }
+}
 
-        FrameQueue* ctrl_frame_queue = client->getCtrlQueue();
-        FrameQueue* data_frame_queue = client->getDataQueue();
-        Frame* frame_to_send;
-        int status, nwrite, chunk_sz, chunk;
-        char* chunk_ptr;
+void ControllerServer::handleTrafficShapingEvent(int shard)
+{
+    int burst = _ts->getBurst();
 
-        /* does last SSL write returned SSL_WANT_WRITE?
-        If yes, resume frame type. */
-        int ssl_partial_frame = client->getWRTmpFrameType();
+    pace_groups(shard);
+    std::vector<char> &due = _group_due[shard];
 
-        bool partial_data_frame = !data_frame_queue->empty() && data_frame_queue->getLastChunk() > 0;
+    ShardStager *shard_stager = stager(shard);
+    if (shard_stager != nullptr) {
+        shard_stager->_ticking.store(true, std::memory_order_relaxed);
+    }
 
-        //Control frames have priority unless we already sent chunks from a data frame
-        if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_CTRL) &&
-            (!partial_data_frame && !ctrl_frame_queue->empty())) {
-            frame_to_send = ctrl_frame_queue->getFrame();
+    auto send_chunks = [this, burst, shard_stager](FdPair* fdp, Client* client) {
+        //chunks encrypted ahead by the stager only need to be sent. A client
+        //the stager is still at is not waited for, nor is its partial output
+        //sent: it sits this tick out and sends its whole burst on the next.
+        bool staged = false, claimed = true;
+        if (shard_stager != nullptr) {
+            staged = client->stageReady();
+            claimed = !staged && client->beginStage();
+            staged = staged || (!claimed && client->stageReady());
+            if (!staged && !claimed) {
+                _deferred_ticks.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
 
-            status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
+        //every client gets the same number of chunks, chaff filling the gaps
+        for (int i = 0; claimed && i < burst; i++) {
+            if (send_chunk(fdp, client) <= 0) {
+                break;
+            }
+        }
 
-            nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
+        //batched backends send the output of the whole tick at once
+        _sp->queue_msg_client(fdp);
 
-            if (nwrite != SSL_TRY_LATER) {
-                ctrl_frame_queue->pop();
-                _frame_pool.unallocFrame(frame_to_send);
-                #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                    _sp->log("Popped from ctrl queue. Left %d ", ctrl_frame_queue->size());
-                #endif
-            } else {
-                client->setWRTmpFrameType(FRAME_TYPE_CTRL);
+        if (shard_stager != nullptr) {
+            client->endStage(false);
+            (staged ? _staged_ticks : _inline_ticks).fetch_add(1,
+                std::memory_order_relaxed);
+        }
+
+        //the queue has room again, read from Tor
+        if (fdp->isOverQuota() &&
+            client->getTotalDataFrames() <= CLIENT_DATA_LOW_WATER) {
+            fdp->setOverQuota(false);
+            _sp->resume_local(fdp);
+        }
+
+        //the tick returned the frames it sent, read the client frames left
+        //in the socket when the pool was full
+        if (fdp->isPoolPaused()) {
+            fdp->setPoolPaused(false);
+            _sp->resume_client(fdp);
+        }
+    };
+
+    //groups slower than the shaper sit this tick out, their clients are
+    //skipped from the table of the shard without being loaded
+    if (_tick_workers > 0) {
+        _client_manager.parallelIterate(shard, &_tick_pool, _tick_workers + 1,
+                                        send_chunks, &due);
+    } else {
+        _client_manager.safeIterate(shard, send_chunks, &due);
+    }
+
+    _sp->submit_msg_clients(shard);
+
+    //encrypt the chunks of the next tick while the shard waits for it
+    if (shard_stager != nullptr) {
+        shard_stager->_ticking.store(false, std::memory_order_relaxed);
+        {
+            std::unique_lock<std::mutex> stage_lock(shard_stager->_mtx);
+            shard_stager->_due = true;
+        }
+        shard_stager->_cv.notify_one();
+    }
+
+    //the first shard also revises the rate, without waiting for the handlers
+    if (shard == 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= _next_rate_update || _rate_pending) {
+            std::unique_lock<std::mutex> ctrl_lock(_ctrl_mtx, std::try_to_lock);
+            if (!ctrl_lock.owns_lock()) {
+                return;
             }
 
-            #if STATS
-                if (nwrite > 0) {
-                    _stats.add_no_data_bytes_sent(nwrite);
-                }
-            #endif
-            #if TIME_STATS
-                type = FRAME_TYPE_CTRL;
-            #endif
+            if (now >= _next_rate_update) {
+                _next_rate_update = now + std::chrono::milliseconds(TS_RATE_UPDATE_MS);
+                _rate_pending = false;
+                ts_rate_sample();
+                ts_rate_update(nullptr, true);
+            } else if (_rate_pending && now >= _rate_deadline) {
+                _rate_pending = false;
+                ts_rate_update();
+            }
+        }
+    }
+}
 
-            //No control frames pending for this client, check for data frames
-        } else if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_DATA) &&
-                    !data_frame_queue->empty()) {
-            frame_to_send = data_frame_queue->getFrame();
-            chunk = data_frame_queue->getLastChunk();
+/* Stager of a shard, NULL without --prestage or when the shard writes its
+clients directly because io_uring is not available. Only called by the tick
+of the shard. */
+ShardStager* ControllerServer::stager(int shard)
+{
+    if (!_prestage) {
+        return nullptr;
+    }
 
-            #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                _sp->log("Got frame from queue.");
-            #endif
+    ShardStager *stager = _stagers[shard];
+    if (!stager->_probed) {
+        stager->_probed = true;
+        if (_sp->batched_msg_clients(shard)) {
+            stager->_thread = std::thread(&ControllerServer::stage_thread,
+                                          this, shard);
+        }
+    }
+    return stager->_thread.joinable() ? stager : nullptr;
+}
 
-            status = frame_to_send->probeChunk(chunk, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
+void ControllerServer::stage_thread(int shard)
+{
+    ShardStager *stager = _stagers[shard];
 
-            nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
-
-            if (nwrite != SSL_TRY_LATER) {
-                if (chunk + 1 < frame_to_send->getNumChunks()) {
-                    data_frame_queue->setLastChunk(chunk + 1);
-                } else {
-                    #if STATS
-                        if (nwrite > 0) {
-                            char* data_ptr; int data_sz;
-                            status = frame_to_send->getDataFrameData(data_ptr, data_sz);
-                            assert(status == FRAME_OK);
-                            _stats.add_bytes_sent(data_sz);
-                        }
-                    #endif
-
-                    data_frame_queue->pop();
-                    _frame_pool.unallocFrame(frame_to_send);
-                    #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                        _sp->log("Popped from data queue. Left %d ", data_frame_queue->size());
-                    #endif
-
-                }
-            } else {
-                client->setWRTmpFrameType(FRAME_TYPE_DATA);
+    while (true) {
+        {
+            std::unique_lock<std::mutex> stage_lock(stager->_mtx);
+            stager->_cv.wait(stage_lock, [this, stager] {
+                return stager->_due || _stop_stagers;
+            });
+            if (_stop_stagers) {
+                return;
             }
+            stager->_due = false;
+        }
 
-            #if TIME_STATS
-                type = FRAME_TYPE_DATA;
-            #endif
+        //the tick writes the clients not reached before it started
+        _client_manager.safeIterate(shard, [this, stager](FdPair *fdp, Client *client) {
+            if (!stager->_ticking.load(std::memory_order_relaxed)) {
+                stage_chunks(fdp, client);
+            }
+        });
+    }
+}
+
+/* Writes the chunks of the next tick of a client into the memory BIO of its
+connection. Data queued after this waits for the tick after the next one. */
+void ControllerServer::stage_chunks(FdPair *fdp, Client *client)
+{
+    if (!_sp->batched_msg_client(fdp) || !client->beginStage()) {
+        return;
+    }
 
-        } else { // Nor control frames nor data frames available, send chaff instead
-            frame_to_send = &_chaff_frame;
+    int burst = _ts->getBurst();
+    int staged = 0;
+    for (int i = 0; i < burst; i++) {
+        if (send_chunk(fdp, client) <= 0) {
+            break;
+        }
+        staged++;
+    }
 
-            status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
-            assert(status == FRAME_OK);
+    client->endStage(staged > 0);
+}
 
-            nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
+#if DATA_FRAMES_SYNC_DLV
+/* Consumes rounds receptions of a client, called under the delivery lock of
+its group. The DATA frames among them go to Tor in one write, or are dropped if
+the client is not active, since it is about to be informed. */
+void ControllerServer::deliver_receptions(FdPair *fdp, Client *client, int rounds)
+{
+    int status, nwrite, size = 0;
+    Frame *frame;
+    char *dout_ptr; int dout_sz;
+    AnonymityGroup *group = _groups[client->getGroup()];
+
+    group->_dlv_iov.clear();
+    group->_dlv_frames.clear();
 
-            if (nwrite == SSL_TRY_LATER) {
-                client->setWRTmpFrameType(FRAME_TYPE_CHAFF);
+    //a client that became valid after the rounds were counted has fewer
+    rounds = std::min(rounds, client->getTotalReceptions());
+    for (int i = 0; i < rounds; i++) {
+        status = client->getReceivedFrame(frame);
+        assert(status != RECP_NO_FRAME_AVAIL);
+
+        if (status == RECP_DATA_FRAME) {
+            group->_dlv_frames.push_back(frame);
+
+            if (client->getState() == CLIENT_STATE_ACTIVE) {
+                status = frame->getDataFrameData(dout_ptr, dout_sz);
+                assert(status == FRAME_OK);
+                group->_dlv_iov.push_back({dout_ptr, (size_t) dout_sz});
+                size += dout_sz;
+            }
+            #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
+            else {
+                _sp->log("Dropped frame from client %d since client is %d!",
+                        fdp->get_fd0(), client->getState());
             }
+            #endif
+        }
 
-            #if STATS
-                if (nwrite > 0) {
-                    _stats.add_no_data_bytes_sent(nwrite);
-                }
+        client->clearReceivedFrame();
+    }
+
+    if (!group->_dlv_iov.empty()) {
+        nwrite = _sp->writevn_msg_local(fdp, group->_dlv_iov.data(),
+                                        group->_dlv_iov.size());
+
+        #if (LOG_VERBOSE & LOG_BIT_CTRL_FRAMES)
+            _sp->log("Delivered %d DATA frames to client %d",
+                     (int) group->_dlv_iov.size(), fdp->get_fd0());
+        #endif
+
+        if (nwrite <= 0) {
+            _sp->shutdown_connection(fdp);
+        }
+        else {
+            assert(nwrite == size);
+
+            #if (LOG_VERBOSE & LOG_BIT_CONN)
+            _sp->log("Wrote (%d) to client (%d), actually (%d)",
+                    size, fdp->get_fd0(), nwrite);
             #endif
 
-            #if TIME_STATS
-                type = FRAME_TYPE_CHAFF;
+            #if STATS
+                _stats.add_tor_bytes_sent(size);
             #endif
         }
+    }
+
+    for (Frame *dlv_frame : group->_dlv_frames) {
+        status = frame_pool(fdp)->unallocFrame(dlv_frame);
+        assert(status == FRAME_OK);
+    }
+
+    if (!group->_dlv_frames.empty() && fdp->isPoolPaused()) {
+        fdp->setPoolPaused(false);
+        _sp->resume_client(fdp);
+    }
+}
+#endif
 
+/* Each tick credits every group of the shard with the shaper period, and a
+group sends once it has gathered its own period. Groups running at the shaper
+rate send on every tick. */
+void ControllerServer::pace_groups(int shard)
+{
+    long period = _ts->getRate();
 
+    for (int group = 0; group < (int) _groups.size(); group++) {
+        long rate = _groups[group]->_ts_rate;
+        long &credit = _group_credit[shard][group];
 
-        if (nwrite <= 0) {
+        credit += period;
+        if (credit >= rate) {
+            _group_due[shard][group] = 1;
+            credit = std::min(credit - rate, rate);
+        } else {
+            _group_due[shard][group] = 0;
+        }
+    }
+}
+
+/* Sends the next chunk of a client: ctrl frames first, then data, else chaff */
+int ControllerServer::send_chunk(FdPair* fdp, Client* client)
+{
+    #if TIME_STATS
+        auto start = std::chrono::high_resolution_clock::now();
+        int type;
+    #endif
+
+    FrameQueue* ctrl_frame_queue = client->getCtrlQueue();
+    FrameQueue* data_frame_queue = client->getDataQueue();
+    Frame* frame_to_send;
+    int status, nwrite, chunk_sz, chunk;
+    char* chunk_ptr;
+    bool chaff = false;
+
+    /* does last SSL write returned SSL_WANT_WRITE?
+    If yes, resume frame type. */
+    int ssl_partial_frame = client->getWRTmpFrameType();
+
+    //TS_RATE frames superseded by a later order are dropped unsent, unless
+    //a write of one is being resumed
+    while (ssl_partial_frame == -1 && !ctrl_frame_queue->empty() &&
+           stale_TS_RATE(client, ctrl_frame_queue->getFrame())) {
+        frame_to_send = ctrl_frame_queue->getFrame();
+        ctrl_frame_queue->pop();
+        frame_pool(fdp)->unallocFrame(frame_to_send);
+        _ts_rate_frames_suppressed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool partial_data_frame = !data_frame_queue->empty() && data_frame_queue->getLastChunk() > 0;
+
+    //Control frames have priority unless we already sent chunks from a data frame
+    if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_CTRL) &&
+        (!partial_data_frame && !ctrl_frame_queue->empty())) {
+        frame_to_send = ctrl_frame_queue->getFrame();
+
+        status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
+
+        nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
+
+        if (nwrite != SSL_TRY_LATER) {
+            ctrl_frame_queue->pop();
+            frame_pool(fdp)->unallocFrame(frame_to_send);
             #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
-                _sp->log("Failed to send! Error %d", nwrite);
+                _sp->log("Popped from ctrl queue. Left %d ", ctrl_frame_queue->size());
             #endif
+        } else {
+            client->setWRTmpFrameType(FRAME_TYPE_CTRL);
         }
-        else {
-            assert(nwrite == chunk_sz);
 
-            if (ssl_partial_frame != -1) {
-                client->setWRTmpFrameType(-1);
+        #if STATS
+            if (nwrite > 0) {
+                _stats.add_no_data_bytes_sent(nwrite);
             }
+        #endif
+        #if TIME_STATS
+            type = FRAME_TYPE_CTRL;
+        #endif
 
-            #if TIME_STATS
-                auto stop = std::chrono::high_resolution_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-                switch (type) {
-                    case FRAME_TYPE_CTRL: _time_stats.addCtrlTime(duration.count()); break;
-                    case FRAME_TYPE_DATA: _time_stats.addDataTime(duration.count()); break;
-                    case FRAME_TYPE_CHAFF: _time_stats.addChaffTime(duration.count());
-                }
-            #endif
+        //No control frames pending for this client, check for data frames. A
+        //frame still being appended to waits for the next tick.
+    } else if ((ssl_partial_frame == -1 || ssl_partial_frame == FRAME_TYPE_DATA) &&
+                !data_frame_queue->empty() && data_frame_queue->getFrame()->seal()) {
+        frame_to_send = data_frame_queue->getFrame();
+        chunk = data_frame_queue->getLastChunk();
+
+        #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+            _sp->log("Got frame from queue.");
+        #endif
+
+        status = frame_to_send->probeChunk(chunk, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
+
+        nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
+
+        if (nwrite != SSL_TRY_LATER) {
+            if (chunk + 1 < frame_to_send->getNumChunks()) {
+                data_frame_queue->setLastChunk(chunk + 1);
+            } else {
+                #if STATS
+                    if (nwrite > 0) {
+                        char* data_ptr; int data_sz;
+                        status = frame_to_send->getDataFrameData(data_ptr, data_sz);
+                        assert(status == FRAME_OK);
+                        _stats.add_bytes_sent(data_sz);
+                    }
+                #endif
+
+                data_frame_queue->pop();
+                frame_pool(fdp)->unallocFrame(frame_to_send);
+                #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+                    _sp->log("Popped from data queue. Left %d ", data_frame_queue->size());
+                #endif
+
+            }
+        } else {
+            client->setWRTmpFrameType(FRAME_TYPE_DATA);
         }
 
-    });
+        #if TIME_STATS
+            type = FRAME_TYPE_DATA;
+        #endif
+
+    } else { // Nor control frames nor data frames available, send chaff instead
+        //a pending write resumes with the chaff frame it started with
+        int chaff_slot = (ssl_partial_frame == FRAME_TYPE_CHAFF) ?
+                         client->getWRTmpChaff() : _chaff_ring.acquire();
+        frame_to_send = _chaff_ring.getFrame(chaff_slot);
+        chaff = true;
+
+        status = frame_to_send->probeChunk(0, chunk_ptr, chunk_sz);
+        assert(status == FRAME_OK);
+
+        nwrite = _sp->writen_msg_client(fdp, chunk_ptr, chunk_sz);
+
+        if (nwrite == SSL_TRY_LATER) {
+            client->setWRTmpFrameType(FRAME_TYPE_CHAFF);
+            client->setWRTmpChaff(chaff_slot);
+        } else {
+            client->setWRTmpChaff(-1);
+            _chaff_ring.release(chaff_slot);
+        }
+
+        #if STATS
+            if (nwrite > 0) {
+                _stats.add_no_data_bytes_sent(nwrite);
+            }
+        #endif
+
+        #if TIME_STATS
+            type = FRAME_TYPE_CHAFF;
+        #endif
+    }
+
+
+
+    if (nwrite <= 0) {
+        #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+            _sp->log("Failed to send! Error %d", nwrite);
+        #endif
+    }
+    else {
+        assert(nwrite == chunk_sz);
+
+        if (ssl_partial_frame != -1) {
+            client->setWRTmpFrameType(-1);
+        }
+
+        AnonymityGroup *group = _groups[client->getGroup()];
+        group->_chunks_sent.fetch_add(1, std::memory_order_relaxed);
+        if (chaff) {
+            group->_chaff_chunks_sent.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        #if TIME_STATS
+            auto stop = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+            switch (type) {
+                case FRAME_TYPE_CTRL: _time_stats.addCtrlTime(duration.count()); break;
+                case FRAME_TYPE_DATA: _time_stats.addDataTime(duration.count()); break;
+                case FRAME_TYPE_CHAFF: _time_stats.addChaffTime(duration.count());
+            }
+        #endif
+    }
+
+    return nwrite;
 }
 
 /* ======================= CTRL Frames Handlers ======================= */
@@ -716,11 +1131,16 @@ void ControllerServer::handleCtrlFrame_HELLO(FdPair *fdp, FrameControlFields &fc
     FrameControlFields reply_fcf;
     int status;
 
-    status = _frame_pool.allocFrame(reply);
+    status = frame_pool(fdp)->allocFrame(reply);
     assert(status == FRAME_OK);
     reply->setFrameType(FRAME_TYPE_CTRL);
 
     status = _client_manager.updateClientKMin(fdp, fcf._k_min);
+
+    int old_group = _client_manager.getClientGroup(fdp);
+    bool was_valid = CLIENT_STATE_VALID(_client_manager.getClientState(fdp));
+    int group = choose_group(fdp, fcf._k_min);
+    _client_manager.updateClientGroup(fdp, group);
     _client_manager.updateClientState(fdp, CLIENT_STATE_CONNECTED);
 
     #if ((LOG_VERBOSE & LOG_BIT_CTRL_FRAMES) && \
@@ -746,8 +1166,9 @@ void ControllerServer::handleCtrlFrame_HELLO(FdPair *fdp, FrameControlFields &fc
     ctrl_fcf._type = FRAME_CTRL_TYPE_ACTIVE;
 
     //order ACTIVE for wating clients whose restriction is now fulfilled
-    for (FdPair *fulfilled_client : _client_manager.getWaitingFulfilledClients()) {
-        status = _frame_pool.allocFrame(ctrl_frame);
+    _client_manager.getWaitingFulfilledClients(group, _ctrl_clients);
+    for (FdPair *fulfilled_client : _ctrl_clients) {
+        status = frame_pool(fulfilled_client)->allocFrame(ctrl_frame);
         assert(status == FRAME_OK);
 
         ctrl_frame->setFrameType(FRAME_TYPE_CTRL);
@@ -765,6 +1186,16 @@ void ControllerServer::handleCtrlFrame_HELLO(FdPair *fdp, FrameControlFields &fc
         _client_manager.updateClientState(fulfilled_client, CLIENT_STATE_ACTIVE);
         _client_manager.getCtrlQueue(fulfilled_client)->push(ctrl_frame);
     }
+
+    //the client now follows the rate of its group, and a repeated HELLO
+    //leaves the clients of its former group with one less
+    if (group != old_group) {
+        if (was_valid) {
+            order_WAIT(old_group);
+            order_CHANGE(old_group);
+        }
+        ts_rate_schedule(fdp);
+    }
 }
 
 void ControllerServer::handleCtrlFrame_HELLO_OK(FdPair *fdp) {
@@ -779,7 +1210,7 @@ void ControllerServer::handleCtrlFrame_ACTIVE(FdPair *fdp) {
     FrameControlFields reply_fcf;
     int status, state;
 
-    status = _frame_pool.allocFrame(reply);
+    status = frame_pool(fdp)->allocFrame(reply);
     assert(status == FRAME_OK);
     reply->setFrameType(FRAME_TYPE_CTRL);
 
@@ -794,7 +1225,7 @@ void ControllerServer::handleCtrlFrame_ACTIVE(FdPair *fdp) {
 
         if (!_client_manager.isClientBroken(fdp)) {
             //order CHANGE for active clients
-            order_CHANGE();
+            order_CHANGE(_client_manager.getClientGroup(fdp));
 
             _sp->restore_local_connection(fdp);
             reply_fcf._type = FRAME_CTRL_TYPE_ACTIVE;
@@ -875,7 +1306,7 @@ void ControllerServer::handleCtrlFrame_INACTIVE(FdPair *fdp) {
     FrameControlFields reply_fcf;
     int status, state;
 
-    status = _frame_pool.allocFrame(reply);
+    status = frame_pool(fdp)->allocFrame(reply);
     assert(status == FRAME_OK);
     reply->setFrameType(FRAME_TYPE_CTRL);
 
@@ -902,7 +1333,7 @@ void ControllerServer::handleCtrlFrame_SHUT(FdPair *fdp) {
     FrameControlFields reply_fcf;
     int status;
 
-    status = _frame_pool.allocFrame(reply);
+    status = frame_pool(fdp)->allocFrame(reply);
     assert(status == FRAME_OK);
     reply->setFrameType(FRAME_TYPE_CTRL);
 
@@ -912,11 +1343,13 @@ void ControllerServer::handleCtrlFrame_SHUT(FdPair *fdp) {
     status = reply->setCtrlFrameData(&reply_fcf);
     assert(status == FRAME_OK);
 
+    int group = _client_manager.getClientGroup(fdp);
+
     //order WAIT for active clients whose restriction is broken
-    order_WAIT();
+    order_WAIT(group);
 
     //order CHANGE for active clients
-    order_CHANGE();
+    order_CHANGE(group);
 
     _client_manager.getCtrlQueue(fdp)->push(reply);
 }
@@ -966,20 +1399,17 @@ void ControllerServer::handleCtrlFrame_UNKNOWN(FdPair *fdp) {
 
 /* ==================== CTRL Frames Creation Helpers ==================== */
 
-void ControllerServer::order_CHANGE() {
-    Frame *change_frame;
+void ControllerServer::order_CHANGE(int group) {
+    Frame *change_frame = nullptr;
     FrameControlFields change_fcf;
     int status;
 
-    for (FdPair *client : _client_manager.getFulfilledClients()) {
-        status = _frame_pool.allocFrame(change_frame);
-        assert(status == FRAME_OK);
-
-        change_frame->setFrameType(FRAME_TYPE_CTRL);
-        change_fcf._type = FRAME_CTRL_TYPE_CHANGE;
-
-        status = change_frame->setCtrlFrameData(&change_fcf);
-        assert(status == FRAME_OK);
+    _client_manager.getFulfilledClients(group, _ctrl_clients);
+    for (FdPair *client : _ctrl_clients) {
+        if (change_frame == nullptr) {
+            change_fcf._type = FRAME_CTRL_TYPE_CHANGE;
+            change_frame = alloc_broadcast_frame(change_fcf);
+        }
 
         #if ((LOG_VERBOSE & LOG_BIT_CTRL_FRAMES) && \
             (LOG_CTRL_TYPES & LOG_CTRL_TYPE_CHANGE))
@@ -992,24 +1422,26 @@ void ControllerServer::order_CHANGE() {
         status = _sp->shutdown_local_connection(client);
         assert(status == 0);
 
+        _frame_pools[0]->retainFrame(change_frame);
         _client_manager.getCtrlQueue(client)->push(change_frame);
     }
+
+    if (change_frame != nullptr) {
+        _frame_pools[0]->unallocFrame(change_frame);
+    }
 }
 
-void ControllerServer::order_WAIT() {
-    Frame *ctrl_frame;
+void ControllerServer::order_WAIT(int group) {
+    Frame *ctrl_frame = nullptr;
     FrameControlFields fcf;
     int status;
 
-    for (FdPair *broken_client : _client_manager.getBrokenClients()) {
-        status = _frame_pool.allocFrame(ctrl_frame);
-        assert(status == FRAME_OK);
-
-        ctrl_frame->setFrameType(FRAME_TYPE_CTRL);
-        fcf._type = FRAME_CTRL_TYPE_WAIT;
-
-        status = ctrl_frame->setCtrlFrameData(&fcf);
-        assert(status == FRAME_OK);
+    _client_manager.getBrokenClients(group, _ctrl_clients);
+    for (FdPair *broken_client : _ctrl_clients) {
+        if (ctrl_frame == nullptr) {
+            fcf._type = FRAME_CTRL_TYPE_WAIT;
+            ctrl_frame = alloc_broadcast_frame(fcf);
+        }
 
         #if ((LOG_VERBOSE & LOG_BIT_CTRL_FRAMES) && \
             (LOG_CTRL_TYPES & LOG_BIT_TYPE_WAIT))
@@ -1022,28 +1454,29 @@ void ControllerServer::order_WAIT() {
         status = _sp->shutdown_local_connection(broken_client);
         assert(status == 0);
 
+        _frame_pools[0]->retainFrame(ctrl_frame);
         _client_manager.getCtrlQueue(broken_client)->push(ctrl_frame);
     }
+
+    if (ctrl_frame != nullptr) {
+        _frame_pools[0]->unallocFrame(ctrl_frame);
+    }
 }
 
-void ControllerServer::order_TS_RATE(unsigned int rate) {
+void ControllerServer::order_TS_RATE(int group, unsigned int rate) {
+    FrameControlFields fcf;
 
     assert(rate >= _ts_min_rate && rate <= _ts_max_rate);
 
-    _client_manager.safeIterate([this, rate](FdPair *fdp, Client *client) {
-        Frame *ctrl_frame;
-        FrameControlFields fcf;
-        int status;
-
-        status = _frame_pool.allocFrame(ctrl_frame);
-        assert(status == FRAME_OK);
-
-        ctrl_frame->setFrameType(FRAME_TYPE_CTRL);
-        fcf._type = FRAME_CTRL_TYPE_TS_RATE;
-        fcf._ts_rate = rate;
+    fcf._type = FRAME_CTRL_TYPE_TS_RATE;
+    fcf._ts_rate = rate;
+    Frame *ctrl_frame = alloc_broadcast_frame(fcf);
 
-        status = ctrl_frame->setCtrlFrameData(&fcf);
-        assert(status == FRAME_OK);
+    _client_manager.safeIterate([this, group, rate, ctrl_frame](FdPair *fdp,
+                                                                Client *client) {
+        if (client->getGroup() != group) {
+            return;
+        }
 
         #if ((LOG_VERBOSE & LOG_BIT_CTRL_FRAMES) && \
             (LOG_CTRL_TYPES & LOG_BIT_TYPE_TS_RATE))
@@ -1051,19 +1484,198 @@ void ControllerServer::order_TS_RATE(unsigned int rate) {
                     rate, fdp->get_fd0());
         #endif
 
+        client->setTsRate(rate);
+        _frame_pools[0]->retainFrame(ctrl_frame);
         client->getCtrlQueue()->push(ctrl_frame);
     });
 
+    _frame_pools[0]->unallocFrame(ctrl_frame);
+}
+
+/* Encodes a ctrl frame once for many clients. Each client queue holds a
+reference taken with retainFrame(), the caller drops its own with
+unallocFrame() once the frame is queued everywhere. */
+Frame* ControllerServer::alloc_broadcast_frame(FrameControlFields &fcf) {
+    Frame *ctrl_frame;
+    int status;
+
+    status = _frame_pools[0]->allocFrame(ctrl_frame);
+    assert(status == FRAME_OK);
+
+    ctrl_frame->setFrameType(FRAME_TYPE_CTRL);
+    status = ctrl_frame->setCtrlFrameData(&fcf);
+    assert(status == FRAME_OK);
+
+    _frame_pools[0]->shareFrame(ctrl_frame);
+    return ctrl_frame;
+}
+
+void ControllerServer::push_TS_RATE(FdPair *fdp, Client *client,
+                                    unsigned int rate) {
+    Frame *ctrl_frame;
+    FrameControlFields fcf;
+    int status;
+
+    status = frame_pool(fdp)->allocFrame(ctrl_frame);
+    assert(status == FRAME_OK);
+
+    ctrl_frame->setFrameType(FRAME_TYPE_CTRL);
+    fcf._type = FRAME_CTRL_TYPE_TS_RATE;
+    fcf._ts_rate = rate;
+
+    status = ctrl_frame->setCtrlFrameData(&fcf);
+    assert(status == FRAME_OK);
+
+    #if ((LOG_VERBOSE & LOG_BIT_CTRL_FRAMES) && \
+        (LOG_CTRL_TYPES & LOG_BIT_TYPE_TS_RATE))
+        _sp->log("Ordering TS_RATE of %d microsec to client %d!",
+                rate, fdp->get_fd0());
+    #endif
+
+    client->setTsRate(rate);
+    client->getCtrlQueue()->push(ctrl_frame);
+}
+
+bool ControllerServer::stale_TS_RATE(Client *client, Frame *frame) {
+    FrameControlFields fcf;
+
+    return frame->getCtrlFrameData(fcf) == FRAME_OK &&
+           fcf._type == FRAME_CTRL_TYPE_TS_RATE &&
+           fcf._ts_rate != client->getTsRate();
+}
+
+/* Collects what the bridge observed since the last sample */
+void ControllerServer::ts_rate_sample() {
+    long ticks = 0, overruns = 0;
+    for (int shard = 0; shard < _ts->getShards(); shard++) {
+        TrafficShaperStats stats = _ts->getStats(shard);
+        ticks += stats._ticks;
+        overruns += stats._overruns;
+    }
+
+    //the shaper statistics may have been cleared meanwhile
+    if (ticks < _rate_ticks || overruns < _rate_overruns) {
+        _rate_ticks = _rate_overruns = 0;
+    }
+
+    for (int group = 0; group < (int) _groups.size(); group++) {
+        AnonymityGroup *g = _groups[group];
+        g->_rate_sample._clients = _client_manager.getGroupSize(group);
+        g->_rate_sample._data_frames = _client_manager.getTotalDataFrames(group);
+        g->_rate_sample._chunks = g->_chunks_sent.exchange(0);
+        g->_rate_sample._chaff_chunks = g->_chaff_chunks_sent.exchange(0);
+        g->_rate_sample._ticks = ticks - _rate_ticks;
+        g->_rate_sample._overruns = overruns - _rate_overruns;
+    }
+
+    _rate_ticks = ticks;
+    _rate_overruns = overruns;
+}
+
+/* Called with _ctrl_mtx held. Orders a new rate to the groups whose rate
+moves, clients that just connected get the current one. */
+void ControllerServer::ts_rate_update(FdPair *new_fdp, bool sampled) {
+    int new_group = (new_fdp != nullptr) ?
+                    _client_manager.getClientGroup(new_fdp) : -1;
+
+    for (int group = 0; group < (int) _groups.size(); group++) {
+        AnonymityGroup *g = _groups[group];
+        unsigned int current = g->_ts_rate;
+        unsigned int rate;
+        RateSample sample = g->_rate_sample;
+
+        //connection changes carry the client count but no new measurements
+        sample._clients = _client_manager.getGroupSize(group);
+        if (sample._clients == 0) {
+            continue;
+        }
+        if (!sampled) {
+            sample._ticks = 0;
+        }
+        rate = g->_rate_controller->update(sample, current);
+
+        if (rate != current) {
+            //send ctrl frame for clients change their TS rate
+            order_TS_RATE(group, rate);
+            g->_ts_rate = rate;
+        } else if (group == new_group) {
+            Client *client = _client_manager.getClient(new_fdp);
+            if (client->getTsRate() != rate) {
+                push_TS_RATE(new_fdp, client, rate);
+            }
+        }
+    }
+
+    ts_rate_apply();
 }
 
-void ControllerServer::ts_rate_update() {
-    unsigned int number_of_users = _client_manager.size();
-    unsigned int rate = (number_of_users <= MAX_LISTEN_USERS) ?
-                                    number_of_users * _ts_min_rate
-                                    : _ts_max_rate;
-    //send ctrl frame for clients change their TS rate
-    order_TS_RATE(rate);
+/* Runs the bridge shaper at the rate of the fastest group with clients */
+void ControllerServer::ts_rate_apply() {
+    unsigned int rate = 0;
+
+    for (int group = 0; group < (int) _groups.size(); group++) {
+        unsigned int group_rate = _groups[group]->_ts_rate;
+        if (group_rate != 0 && _client_manager.getGroupSize(group) > 0 &&
+            (rate == 0 || group_rate < rate)) {
+            rate = group_rate;
+        }
+    }
 
     //change bridge TS rate
-    _ts->setRate(rate);
+    if (rate != 0 && rate != (unsigned int) _ts->getRate()) {
+        _ts->setRate(rate);
+    }
+}
+
+/* Picks the anonymity group of a client once its k_min is known */
+int ControllerServer::choose_group(FdPair *fdp, int k_min) {
+    int groups = _client_manager.getNumberGroups();
+    int current = _client_manager.getClientGroup(fdp);
+    int group = 0;
+
+    if (_group_by == GROUP_BY_KMIN) {
+        //group i takes k_min in [2^i, 2^(i+1)), the last one everything above
+        while (group < groups - 1 && k_min >= (2 << group)) {
+            group++;
+        }
+    } else {
+        //the client is still counted in its current group
+        int best = -1;
+        for (int g = 0; g < groups; g++) {
+            int size = _client_manager.getGroupSize(g) - (g == current ? 1 : 0);
+            if (best == -1 || size < best) {
+                best = size;
+                group = g;
+            }
+        }
+    }
+
+    return group;
+}
+
+/* Called with _ctrl_mtx held on connection changes. A new client gets the
+current rate right away, the rate itself is revised once the churn settles. */
+void ControllerServer::ts_rate_schedule(FdPair *new_fdp) {
+    if (new_fdp != nullptr) {
+        unsigned int rate = _groups[_client_manager.getClientGroup(new_fdp)]->_ts_rate;
+
+        //no rate ordered to its group yet, nothing to coalesce with
+        if (rate == 0) {
+            ts_rate_update(new_fdp);
+            return;
+        }
+
+        Client *client = _client_manager.getClient(new_fdp);
+        if (client->getTsRate() != rate) {
+            push_TS_RATE(new_fdp, client, rate);
+        }
+    }
+
+    if (_rate_pending) {
+        _rate_updates_coalesced.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        _rate_deadline = std::chrono::steady_clock::now() +
+                         std::chrono::milliseconds(TS_RATE_DEBOUNCE_MS);
+        _rate_pending = true;
+    }
 }
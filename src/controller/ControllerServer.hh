@@ -3,23 +3,77 @@
 
 #include "TrafficShaper.hh"
 #include "FramePool.hh"
+#include "ChaffRing.hh"
 #include "ClientManager.hh"
+#include "RateController.hh"
 #include <map>
+#include <chrono>
 
 class TorPTServer;
 class SocksProxyServer;
 class CliUnixServer;
 class FdPair;
 
+/* How clients are spread over the anonymity groups of the bridge once their
+HELLO is received: by power of two of k_min, so that clients asking for
+similar anonymity share a group, or into the group with the fewest clients */
+#define GROUP_BY_KMIN       (1)
+#define GROUP_BY_CAPACITY   (2)
+
+#define VALID_GROUP_BY(g)   (g == GROUP_BY_KMIN || g == GROUP_BY_CAPACITY)
+
+/* Maximum number of anonymity groups of a bridge */
+#define MAX_GROUPS          (16)
+
+/* Shaper rate of one anonymity group. Updated under _ctrl_mtx but for the
+ * chunk counters, updated by the ticks. */
+struct AnonymityGroup {
+    RateController *_rate_controller = nullptr;
+    RateSample _rate_sample;
+
+    /* Rate last ordered to the group, 0 until its first client arrives */
+    std::atomic<unsigned int> _ts_rate{0};
+
+    std::atomic<long> _chunks_sent{0};
+    std::atomic<long> _chaff_chunks_sent{0};
+
+    #if DATA_FRAMES_SYNC_DLV
+        /* DATA frames of one client delivered to Tor in the current rounds,
+        reused under the delivery lock of the group */
+        std::vector<struct iovec> _dlv_iov;
+        std::vector<Frame*> _dlv_frames;
+    #endif
+};
+
+/* Thread that encrypts the chunks of the next tick for the clients of a shard
+ * (--prestage), woken at the end of each tick of the shard. Started by the
+ * first tick of the shard, only when its clients are written to io_uring. */
+struct ShardStager {
+    std::thread _thread;
+    std::mutex _mtx;
+    std::condition_variable _cv;
+    bool _due = false;
+    bool _probed = false;
+
+    /* Set while the tick of the shard runs, the stager leaves the clients it
+    has not reached yet to the tick */
+    std::atomic<bool> _ticking{false};
+};
+
 class ControllerServer : public Controller {
 
 public:
 
     ControllerServer(int max_chunks, int chunk_size, int ts_min_rate,
                      int ts_max_rate, TorPTServer *pt, SocksProxyServer *sp,
-                     CliUnixServer *cli, TrafficShaper *ts);
+                     CliUnixServer *cli, TrafficShaper *ts, int shards = 1,
+                     int tick_workers = 0,
+                     int rate_control = TS_RATE_CONTROL_ADAPTIVE,
+                     int groups = 1, int group_by = GROUP_BY_KMIN,
+                     int frame_sizing = FRAME_SIZING_FIXED,
+                     bool prestage = false);
 
-    ~ControllerServer(){};
+    ~ControllerServer();
 
     void handleSocksNewConnection(FdPair *fds);
 
@@ -33,6 +87,8 @@ public:
 
     void handleTrafficShapingEvent();
 
+    void handleTrafficShapingEvent(int shard);
+
     void handleCtrlFrame(FdPair *fdp, Frame *frame);
 
     void handleCtrlFrame_NULL     (FdPair *fdp);
@@ -65,19 +121,110 @@ protected:
     int _chunk_size;
     int _ts_min_rate;
     int _ts_max_rate;
+    int _frame_sizing;
+
+    /* One frame pool per shard. Frames of a client always come from and
+    return to the pool of the shard that owns the client. */
+    std::vector<FramePool*> _frame_pools;
 
-    FramePool _frame_pool;
-    Frame _chaff_frame;
+    /* Fresh chaff frames, refilled off the traffic shaper tick */
+    ChaffRing _chaff_ring;
 
     TrafficShaper *_ts;
 
     ClientManager _client_manager;
 
+    /* Workers that send the chunks of a shaper tick alongside the shaper
+    thread, so that one slow client does not delay the clients behind it.
+    No pool threads when 0. */
+    int _tick_workers;
+    ThreadPool _tick_pool;
+
+    /* With prestage, the chunks of a client are encrypted into the memory BIO
+    of its connection by the stager of its shard after each tick, and the
+    next tick only hands the ciphertext to io_uring. Clients whose chunks are
+    not ready, or that are not on io_uring, are written by the tick itself;
+    the ones the stager is still writing are deferred: they send nothing on
+    the tick, not even what is already encrypted, and their whole burst on
+    the next one. */
+    bool _prestage;
+    std::vector<ShardStager*> _stagers;
+    bool _stop_stagers;
+    std::atomic<long> _staged_ticks;
+    std::atomic<long> _inline_ticks;
+    std::atomic<long> _deferred_ticks;
+
+    /* Anonymity groups, each with its own k-anonymity set, rate and
+    synchronized delivery. The bridge shaper ticks at the rate of the fastest
+    group, slower groups skip ticks. */
+    std::vector<AnonymityGroup*> _groups;
+    int _group_by;
+
+    /* Per shard and group, shaper time not yet used by the group and whether
+    the group sends on the current tick. Only touched by the shard's tick. */
+    std::vector<std::vector<long>> _group_credit;
+    std::vector<std::vector<char>> _group_due;
+
+    /* Shaper ticks and overruns seen by the last rate sample */
+    long _rate_ticks = 0;
+    long _rate_overruns = 0;
+    std::chrono::steady_clock::time_point _next_rate_update;
+
+    /* Rate update requested by connection changes, run by the tick once
+    TS_RATE_DEBOUNCE_MS have passed since the first of them */
+    std::atomic<bool> _rate_pending;
+    std::chrono::steady_clock::time_point _rate_deadline;
+
+    /* Rate updates merged into a later one, and queued TS_RATE frames
+    dropped because a later order superseded them */
+    std::atomic<long> _rate_updates_coalesced;
+    std::atomic<long> _ts_rate_frames_suppressed;
+
+    /* Times reads from a local Tor connection stopped because the data queue
+    of its client was over quota or the frame pool was full, and reads from a
+    client because the frame pool was full */
+    std::atomic<long> _quota_pauses;
+
+    /* Reads from local Tor appended to a queued data frame */
+    std::atomic<long> _coalesced_reads;
+
+    /* Serializes the k-anonymity state machine (connections and ctrl frames)
+    across shards. Socket I/O, DATA and chaff receptions and synchronous
+    delivery run outside of it. */
+    std::mutex _ctrl_mtx;
+
+    /* Clients picked by the k-anonymity checks, reused under _ctrl_mtx */
+    std::vector<FdPair*> _ctrl_clients;
+
 private:
-    void order_CHANGE();
-    void order_WAIT();
-    void order_TS_RATE(unsigned int rate);
-    void ts_rate_update();
+    FramePool* frame_pool(FdPair *fdp);
+
+    int send_chunk(FdPair *fdp, Client *client);
+
+    ShardStager* stager(int shard);
+    void stage_thread(int shard);
+    void stage_chunks(FdPair *fdp, Client *client);
+
+    #if DATA_FRAMES_SYNC_DLV
+        void deliver_receptions(FdPair *fdp, Client *client, int rounds);
+    #endif
+
+    int getNumAllocFrames();
+    int getNumUnallocFrames();
+    int getFramePoolSize();
+
+    void order_CHANGE(int group);
+    void order_WAIT(int group);
+    void order_TS_RATE(int group, unsigned int rate);
+    void push_TS_RATE(FdPair *fdp, Client *client, unsigned int rate);
+    bool stale_TS_RATE(Client *client, Frame *frame);
+    Frame* alloc_broadcast_frame(FrameControlFields &fcf);
+    void ts_rate_update(FdPair *new_fdp = nullptr, bool sampled = false);
+    void ts_rate_schedule(FdPair *new_fdp = nullptr);
+    void ts_rate_sample();
+    void ts_rate_apply();
+    int choose_group(FdPair *fdp, int k_min);
+    void pace_groups(int shard);
 
     #if STATS
         Stats _stats;
@@ -1,18 +1,88 @@
 #ifndef FDPAIR_HH
 #define FDPAIR_HH
 
+#include <atomic>
 #include "../common/Common.hh"
 
 #define INV_FD (-1)
 
+/* Ends of a FdPair, used to tag reactor events */
+#define FDPAIR_END_CLIENT (0)
+#define FDPAIR_END_LOCAL  (1)
+
+class FdPair;
+
+/* Client output queued for the io_uring send backend. Guarded by the uring
+ * mutex of the owner shard. */
+struct FdPairTx {
+    /* Bytes handed to the kernel start at _off */
+    std::vector<char> _buf;
+    size_t _off = 0;
+
+    /* Plain (non-SSL) bytes written since the last submission. With SSL they
+     * accumulate in the memory BIO of the connection instead. */
+    std::vector<char> _next;
+
+    bool _enabled = false;
+    bool _inflight = false;
+    bool _error = false;
+};
+
+/* Output for the local (Tor) end that did not fit in its socket buffer, sent
+ * from _off when the end becomes writable. Guarded by the local mutex. */
+struct FdPairLocalOut {
+    std::vector<char> _buf;
+    size_t _off = 0;
+
+    /* Reads from the local end stopped above the high-water mark */
+    bool _paused = false;
+
+    size_t pending() {
+        return _buf.size() - _off;
+    }
+
+    void clear() {
+        _buf.clear();
+        _off = 0;
+    }
+};
+
+/* Decrypted TLS data not yet consumed as frames, valid between _head and
+ * _tail. Guarded by the SSL mutex of the connection. */
+struct FdPairRx {
+    std::vector<char> _buf;
+    size_t _head = 0;
+    size_t _tail = 0;
+
+    /* Frame geometry of the last read */
+    int _chunk_sz = 0;
+    int _max_chunks = 0;
+
+    /* The peer closed (0) or the connection failed (-1) after the data in the
+    buffer, reported once it is consumed */
+    bool _ended = false;
+    int _end_status = 0;
+};
+
+/* Stored in the epoll data pointer so that an event resolves directly to the
+ * FdPair and to the end (fd0 / fd1) that became ready. */
+struct FdPairEnd {
+    FdPair *_fdp;
+    int _end;
+};
+
 class FdPair {
 
     public:
 
         #if USE_SSL
-            FdPair(int fd0, int fd1, SSL *ssl): _fd0(fd0), _fd1(fd1), _ssl(ssl) {};
+            FdPair(int fd0, int fd1, SSL *ssl): _fd0(fd0), _fd1(fd1), _ssl(ssl) {
+                init_ends();
+            };
         #else
-            FdPair(int fd0, int fd1): _fd0(fd0), _fd1(fd1) {};
+            FdPair(int fd0, int fd1): _fd0(fd0), _fd1(fd1) {
+                init_ends();
+            };
         #endif
 
         ~FdPair() {}
@@ -33,6 +103,84 @@ class FdPair {
             _fd1 = fd1;
         }
 
+        FdPairEnd* getEnd(int end) {
+            return &_ends[end];
+        }
+
+        /* Edge-triggered readiness: set when the reactor receives an event for
+         * the end and cleared by the read helpers once the end is drained. */
+        bool isReadable(int end) {
+            return _readable[end];
+        }
+
+        void setReadable(int end, bool readable) {
+            _readable[end] = readable;
+        }
+
+        bool isScheduled() {
+            return _scheduled;
+        }
+
+        void setScheduled(bool scheduled) {
+            _scheduled = scheduled;
+        }
+
+        /* Reactor (and client partition, frame pool and shaper tick) that
+         * owns this connection. */
+        int getShard() {
+            return _shard;
+        }
+
+        void setShard(int shard) {
+            _shard = shard;
+        }
+
+        /* Slot of the client of this connection in the table of its
+         * partition, -1 when it has none. */
+        int getClientSlot() {
+            return _client_slot;
+        }
+
+        void setClientSlot(int slot) {
+            _client_slot = slot;
+        }
+
+        /* Set by the owner reactor when reads from the local end stop because
+         * the data queue of the client is over quota, cleared by the shaper
+         * tick that drains it. */
+        bool isOverQuota() {
+            return _over_quota;
+        }
+
+        void setOverQuota(bool over_quota) {
+            _over_quota = over_quota;
+        }
+
+        /* Set by the owner reactor when reads from the client end stop
+         * because the frame pool of the shard is full, cleared by the shaper
+         * tick or the delivery that frees frames. */
+        bool isPoolPaused() {
+            return _pool_paused;
+        }
+
+        void setPoolPaused(bool pool_paused) {
+            _pool_paused = pool_paused;
+        }
+
+        FdPairTx* getTx() {
+            return &_tx;
+        }
+
+        FdPairLocalOut* getLocalOut() {
+            return &_local_out;
+        }
+
+        /* Serializes operations on the local (Tor) end, which other shards
+         * may shut down or restore while the owner reactor reads from it. */
+        std::mutex& getLocalMutex() {
+            return _local_mtx;
+        }
+
         #if USE_SSL
             void setSSL(SSL* ssl) {
                 _ssl = ssl;
@@ -42,17 +190,83 @@ class FdPair {
                 return _ssl;
             }
 
-            int SSL_readn(void *buf, int n)
+            /* True while the TLS handshake of an accepted connection is
+             * still being driven by the reactor. */
+            bool isHandshaking() {
+                return _handshaking;
+            }
+
+            void setHandshaking(bool handshaking) {
+                _handshaking = handshaking;
+            }
+
+            /* Copies the next complete frame to buf and returns its size.
+             * Decrypted data is buffered per connection, so a frame split
+             * across TLS records is resumed on the next call. Returns
+             * SSL_TRY_LATER once the socket is drained without completing a
+             * frame, 0 when the peer closed and -1 on errors. */
+            int SSL_readframe(char *buf, int chunk_sz, int max_chunks)
             {
-                int nread, error;
+                int frame_sz, status;
                 std::unique_lock<std::mutex> res_lock(_ssl_mtx);
-                nread = SSL_peek(_ssl, buf, n);
-                error = SSL_get_error(_ssl, nread);
-                switch (nread) {
-                    case 0 : return 0;
-                    case -1: return ((error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) ? SSL_TRY_LATER : -1);
-                    default: return ((nread == n) ? SSL_read(_ssl, buf, n) : SSL_TRY_LATER);
+
+                size_t capacity = FDPAIR_RX_FRAMES * max_chunks * chunk_sz;
+                if (_rx._buf.size() < capacity) {
+                    _rx._buf.resize(capacity);
                 }
+                _rx._chunk_sz = chunk_sz;
+                _rx._max_chunks = max_chunks;
+
+                frame_sz = rx_frame_size(chunk_sz, max_chunks);
+                if (frame_sz == 0) {
+                    status = rx_fill();
+                    if (status == 0 || status == -1) {
+                        return status;
+                    }
+                    frame_sz = rx_frame_size(chunk_sz, max_chunks);
+                    if (frame_sz == 0) {
+                        return _rx._ended ? _rx._end_status : SSL_TRY_LATER;
+                    }
+                }
+                if (frame_sz < 0) {
+                    return -1;
+                }
+
+                memcpy(buf, &_rx._buf[_rx._head], frame_sz);
+                _rx._head += frame_sz;
+                return frame_sz;
+            }
+
+            /* True when the next frame is already buffered, or invalid, or
+             * the connection ended after the buffered frames */
+            bool SSL_rx_frame_ready()
+            {
+                std::unique_lock<std::mutex> res_lock(_ssl_mtx);
+                return _rx._chunk_sz > 0 &&
+                       (_rx._ended || rx_frame_size(_rx._chunk_sz, _rx._max_chunks) != 0);
+            }
+
+            /* Bytes waiting in the write BIO, when it is a memory BIO */
+            int SSL_wbio_pending()
+            {
+                std::unique_lock<std::mutex> res_lock(_ssl_mtx);
+                return BIO_ctrl_pending(SSL_get_wbio(_ssl));
+            }
+
+            /* Moves the ciphertext of the write memory BIO to the end of out */
+            int SSL_drain_wbio(std::vector<char> &out)
+            {
+                std::unique_lock<std::mutex> res_lock(_ssl_mtx);
+                BIO *wbio = SSL_get_wbio(_ssl);
+                int pending = BIO_ctrl_pending(wbio);
+                if (pending <= 0) {
+                    return 0;
+                }
+                size_t used = out.size();
+                out.resize(used + pending);
+                int nread = BIO_read(wbio, out.data() + used, pending);
+                out.resize(used + (nread > 0 ? nread : 0));
+                return nread;
             }
 
             int SSL_writen(void *buf, int n)
@@ -71,12 +285,97 @@ class FdPair {
 
     private:
 
+        void init_ends() {
+            for (int end = FDPAIR_END_CLIENT; end <= FDPAIR_END_LOCAL; end++) {
+                _ends[end]._fdp = this;
+                _ends[end]._end = end;
+                _readable[end] = false;
+            }
+            _scheduled = false;
+        }
+
+        #if USE_SSL
+            /* Size of the buffered frame at _head, 0 while it is incomplete
+             * and -1 when its chunk count is invalid */
+            int rx_frame_size(int chunk_sz, int max_chunks)
+            {
+                size_t used = _rx._tail - _rx._head;
+                if (used < (size_t) chunk_sz) {
+                    return 0;
+                }
+
+                int num_chunks = (unsigned char) _rx._buf[_rx._head];
+                if (num_chunks <= 0 || num_chunks > max_chunks) {
+                    return -1;
+                }
+
+                size_t frame_sz = num_chunks * chunk_sz;
+                return (used < frame_sz) ? 0 : frame_sz;
+            }
+
+            /* Decrypts everything available, until SSL wants to read from the
+             * socket or the buffer is full, after moving leftovers to the
+             * front. Returns the number of new bytes, SSL_TRY_LATER when
+             * there were none, 0 when the peer closed and -1 on errors. A
+             * close or error met after new bytes is returned by the next
+             * call, so the frames received before it are still read. */
+            int rx_fill()
+            {
+                int nread, error, total = 0;
+
+                if (_rx._ended) {
+                    return _rx._end_status;
+                }
+
+                if (_rx._head > 0) {
+                    memmove(&_rx._buf[0], &_rx._buf[_rx._head], _rx._tail - _rx._head);
+                    _rx._tail -= _rx._head;
+                    _rx._head = 0;
+                }
+
+                while (_rx._tail < _rx._buf.size()) {
+                    nread = SSL_read(_ssl, &_rx._buf[_rx._tail], _rx._buf.size() - _rx._tail);
+                    if (nread <= 0) {
+                        error = SSL_get_error(_ssl, nread);
+                        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                            break;
+                        }
+                        _rx._ended = true;
+                        _rx._end_status = (error == SSL_ERROR_ZERO_RETURN) ? 0 : -1;
+                        break;
+                    }
+                    _rx._tail += nread;
+                    total += nread;
+                }
+
+                if (total > 0) {
+                    return total;
+                }
+                return _rx._ended ? _rx._end_status : SSL_TRY_LATER;
+            }
+        #endif
+
         int _fd0;
         int _fd1;
 
+        FdPairEnd _ends[2];
+        std::atomic<bool> _readable[2];
+        bool _scheduled;
+
+        int _shard = 0;
+        int _client_slot = -1;
+        std::atomic<bool> _over_quota{false};
+        std::atomic<bool> _pool_paused{false};
+        std::mutex _local_mtx;
+        FdPairLocalOut _local_out;
+
+        FdPairTx _tx;
+
         #if USE_SSL
             SSL* _ssl;
             std::mutex _ssl_mtx;
+            bool _handshaking = false;
+            FdPairRx _rx;
         #endif
 };
 
@@ -11,8 +11,50 @@
 #define FRAME_TYPE_FIELD        (1)
 #define CTRL_FRAME_TYPE_FIELD   (2)
 #define CTRL_FRAME_HEADER_SIZE  ((CTRL_FRAME_TYPE_FIELD) + sizeof(unsigned int))
+#define CTRL_FRAME_PARAM_FIELD  (CTRL_FRAME_HEADER_SIZE)
 
 
+/* Header fields are big endian */
+static inline void store_be32(char *dst, unsigned int value)
+{
+    value = htonl(value);
+    memcpy(dst, &value, sizeof(value));
+}
+
+
+static inline unsigned int load_be32(const char *src)
+{
+    unsigned int value;
+    memcpy(&value, src, sizeof(value));
+    return ntohl(value);
+}
+
+
+/* Parameter bytes of a ctrl frame, -1 for unknown types */
+static inline int ctrl_param_size(int ctrl_type)
+{
+    switch (ctrl_type) {
+        case FRAME_CTRL_TYPE_HELLO:
+            return FRAME_CTRL_SIZE_HELLO;
+        case FRAME_CTRL_TYPE_TS_RATE:
+            return FRAME_CTRL_SIZE_TS_RATE;
+        case FRAME_CTRL_TYPE_HELLO_OK:
+        case FRAME_CTRL_TYPE_ACTIVE:
+        case FRAME_CTRL_TYPE_WAIT:
+        case FRAME_CTRL_TYPE_CHANGE:
+        case FRAME_CTRL_TYPE_CHANGE_OK:
+        case FRAME_CTRL_TYPE_INACTIVE:
+        case FRAME_CTRL_TYPE_SHUT:
+        case FRAME_CTRL_TYPE_SHUT_OK:
+        case FRAME_CTRL_TYPE_ERR_HELLO:
+        case FRAME_CTRL_TYPE_ERR_ACTIVE:
+        case FRAME_CTRL_TYPE_ERR_INACTIVE:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
 Frame::Frame(int max_chunks, int chunk_size)
 {
     assert(max_chunks > 0 && max_chunks < 256);
@@ -20,11 +62,26 @@ Frame::Frame(int max_chunks, int chunk_size)
     _chunk_size = chunk_size;
     _buffer_size = _max_chunks * _chunk_size;
     _buffer = new char[_buffer_size]();
+    _own_buffer = true;
+};
+
+
+Frame::Frame(int max_chunks, int chunk_size, char *buffer)
+{
+    assert(max_chunks > 0 && max_chunks < 256);
+    assert(buffer != NULL);
+    _max_chunks = max_chunks;
+    _chunk_size = chunk_size;
+    _buffer_size = _max_chunks * _chunk_size;
+    _buffer = buffer;
+    _own_buffer = false;
 };
 
 
 Frame::~Frame() {
-    delete[] _buffer;
+    if (_own_buffer) {
+        delete[] _buffer;
+    }
 }
 
 
@@ -165,9 +222,7 @@ void Frame::printFrameInfo(std::ostream &out)
 
     case FRAME_TYPE_DATA:
         out << "Frame Type: DATA" << std::endl;
-        unsigned int size_raw;
-        memcpy((char*)&size_raw, &_buffer[DATA_FRAME_SIZE_FIELD], sizeof(size_raw));
-        out << "Data Size: " << ntohl(size_raw) << std::endl;
+        out << "Data Size: " << load_be32(&_buffer[DATA_FRAME_SIZE_FIELD]) << std::endl;
         break;
 
     case FRAME_TYPE_CHAFF:
@@ -177,20 +232,15 @@ void Frame::printFrameInfo(std::ostream &out)
     case FRAME_TYPE_CTRL:
         {
             out << "Frame Type: CTRL" << std::endl;
-            unsigned int ctrl_type_raw;
-            memcpy((char*)&ctrl_type_raw, &_buffer[CTRL_FRAME_TYPE_FIELD],
-                sizeof(ctrl_type_raw));
-            unsigned int ctrl_type = ntohl(ctrl_type_raw);
-            unsigned int k_min_raw, k_min;
+            unsigned int ctrl_type = load_be32(&_buffer[CTRL_FRAME_TYPE_FIELD]);
+            unsigned int k_min;
 
 
             switch (ctrl_type) {
                 case FRAME_CTRL_TYPE_HELLO:
                     out << "Ctrl Type: HELLO" << std::endl;
 
-                    memcpy((char*)&k_min_raw, &_buffer[CTRL_FRAME_HEADER_SIZE],
-                        sizeof(k_min_raw));
-                    k_min = ntohl(k_min_raw);
+                    k_min = load_be32(&_buffer[CTRL_FRAME_PARAM_FIELD]);
 
                     out << "\tK-min : " << k_min << std::endl;
 
@@ -299,11 +349,11 @@ int Frame::setDataFrameData(char *data_ptr, int data_sz)
         return FRAME_ERR_INSUFF_SPACE;
     }
 
-    _buffer[FRAME_CHUNKS_FIELD] = total_sz / _chunk_size +
-                                    ((total_sz % _chunk_size > 0)?1:0);
+    //Single chunk frames, the default geometry, need no division
+    _buffer[FRAME_CHUNKS_FIELD] = (_max_chunks == 1) ? 1 :
+                                  (total_sz + _chunk_size - 1) / _chunk_size;
 
-    unsigned int data_size = htonl(data_sz);
-    memcpy(&_buffer[DATA_FRAME_SIZE_FIELD], &data_size, sizeof(data_size));
+    store_be32(&_buffer[DATA_FRAME_SIZE_FIELD], data_sz);
     memcpy(&_buffer[DATA_FRAME_HEADER_SIZE], data_ptr, data_sz);
 
     return FRAME_OK;
@@ -322,16 +372,23 @@ int Frame::getDataFrameData(char *(&data_ptr), int &data_sz)
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    unsigned int size_raw;
-    memcpy((char*)&size_raw, &_buffer[DATA_FRAME_SIZE_FIELD], sizeof(size_raw));
-    data_sz = ntohl(size_raw);
+    data_sz = load_be32(&_buffer[DATA_FRAME_SIZE_FIELD]);
     data_ptr = &_buffer[DATA_FRAME_HEADER_SIZE];
 
     return FRAME_OK;
 }
 
 
-int Frame::getDataFrameSpace(char *(&data_ptr), int &space_sz)
+int Frame::capacity(int chunks)
+{
+    if (chunks < 0 || chunks > _max_chunks) {
+        chunks = _max_chunks;
+    }
+    return chunks * _chunk_size - DATA_FRAME_HEADER_SIZE;
+}
+
+
+int Frame::getDataFrameSpace(char *(&data_ptr), int &space_sz, int chunks)
 {
     int num_chunks = (int) _buffer[FRAME_CHUNKS_FIELD];
     if (num_chunks == 0) {
@@ -343,7 +400,7 @@ int Frame::getDataFrameSpace(char *(&data_ptr), int &space_sz)
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    space_sz = _buffer_size - DATA_FRAME_HEADER_SIZE;
+    space_sz = capacity(chunks);
     data_ptr = &_buffer[DATA_FRAME_HEADER_SIZE];
     return FRAME_OK;
 }
@@ -361,22 +418,72 @@ int Frame::setDataFrameSize(int data_sz)
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    if (data_sz < 0 || data_sz > (_buffer_size - DATA_FRAME_HEADER_SIZE)) {
+    if ((unsigned int) data_sz > (unsigned int) (_buffer_size - DATA_FRAME_HEADER_SIZE)) {
         return FRAME_ERR_WRONG_DATA_SIZE;
     }
 
-    unsigned int data_size = htonl(data_sz);
-    memcpy(&_buffer[DATA_FRAME_SIZE_FIELD], &data_size, sizeof(data_size));
+    store_be32(&_buffer[DATA_FRAME_SIZE_FIELD], data_sz);
     int total_sz = data_sz + DATA_FRAME_HEADER_SIZE;
-    _buffer[FRAME_CHUNKS_FIELD] =
-        total_sz / _chunk_size +
-        ((total_sz % _chunk_size > 0)?1:0);
+    _buffer[FRAME_CHUNKS_FIELD] = (_max_chunks == 1) ? 1 :
+                                  (total_sz + _chunk_size - 1) / _chunk_size;
 
     return FRAME_OK;
 }
 
 
-int Frame::setChaffFrameData()
+int Frame::getDataFrameTail(char *(&tail_ptr), int &free_sz, int chunks)
+{
+    char *data_ptr;
+    int data_sz;
+
+    int status = getDataFrameData(data_ptr, data_sz);
+    if (status != FRAME_OK) {
+        return status;
+    }
+
+    tail_ptr = data_ptr + data_sz;
+    free_sz = capacity(chunks) - data_sz;
+    if (free_sz < 0) {
+        free_sz = 0;
+    }
+    return FRAME_OK;
+}
+
+
+void Frame::unseal()
+{
+    _seal.store(FRAME_SEAL_OPEN, std::memory_order_release);
+}
+
+
+bool Frame::beginAppend()
+{
+    int open = FRAME_SEAL_OPEN;
+    return _seal.compare_exchange_strong(open, FRAME_SEAL_APPENDING,
+                                         std::memory_order_acquire);
+}
+
+
+void Frame::endAppend(bool seal)
+{
+    assert(_seal.load(std::memory_order_relaxed) == FRAME_SEAL_APPENDING);
+    _seal.store(seal ? FRAME_SEAL_SEALED : FRAME_SEAL_OPEN,
+                std::memory_order_release);
+}
+
+
+bool Frame::seal()
+{
+    int state = FRAME_SEAL_OPEN;
+    if (_seal.compare_exchange_strong(state, FRAME_SEAL_SEALED,
+                                      std::memory_order_acquire)) {
+        return true;
+    }
+    return state == FRAME_SEAL_SEALED;
+}
+
+
+int Frame::getChaffFrameSpace(char *(&chaff_ptr), int &chaff_sz)
 {
     int num_chunks = (int) _buffer[FRAME_CHUNKS_FIELD];
     if (num_chunks == 0) {
@@ -388,8 +495,25 @@ int Frame::setChaffFrameData()
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    for (int i = FRAME_TYPE_FIELD + 1; i < num_chunks * _chunk_size; i++) {
-        _buffer[i] = (char) (0xff & rand());
+    chaff_ptr = &_buffer[FRAME_TYPE_FIELD + 1];
+    chaff_sz = num_chunks * _chunk_size - (FRAME_TYPE_FIELD + 1);
+
+    return FRAME_OK;
+}
+
+
+int Frame::setChaffFrameData()
+{
+    char *chaff_ptr;
+    int chaff_sz;
+
+    int status = getChaffFrameSpace(chaff_ptr, chaff_sz);
+    if (status != FRAME_OK) {
+        return status;
+    }
+
+    for (int i = 0; i < chaff_sz; i++) {
+        chaff_ptr[i] = (char) (0xff & rand());
     }
 
     return FRAME_OK;
@@ -410,53 +534,26 @@ int Frame::setCtrlFrameData(FrameControlFields *ctrl)
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    int data_sz;
-    switch (ctrl->_type) {
-        case FRAME_CTRL_TYPE_HELLO:
-            data_sz = FRAME_CTRL_SIZE_HELLO;
-            break;
-        case FRAME_CTRL_TYPE_TS_RATE:
-            data_sz = FRAME_CTRL_SIZE_TS_RATE;
-            break;
-        case FRAME_CTRL_TYPE_HELLO_OK:
-        case FRAME_CTRL_TYPE_ACTIVE:
-        case FRAME_CTRL_TYPE_WAIT:
-        case FRAME_CTRL_TYPE_CHANGE:
-        case FRAME_CTRL_TYPE_CHANGE_OK:
-        case FRAME_CTRL_TYPE_INACTIVE:
-        case FRAME_CTRL_TYPE_SHUT:
-        case FRAME_CTRL_TYPE_SHUT_OK:
-        case FRAME_CTRL_TYPE_ERR_ACTIVE:
-        case FRAME_CTRL_TYPE_ERR_INACTIVE:
-            data_sz = 0;
-            break;
-        default:
-            return FRAME_ERR_WRONG_CTRL_TYPE;
+    //ERR_HELLO is decoded but never sent
+    int param_sz = ctrl_param_size(ctrl->_type);
+    if (param_sz < 0 || ctrl->_type == FRAME_CTRL_TYPE_ERR_HELLO) {
+        return FRAME_ERR_WRONG_CTRL_TYPE;
     }
 
-    int total_sz = data_sz + CTRL_FRAME_HEADER_SIZE;
-
+    int total_sz = CTRL_FRAME_HEADER_SIZE + param_sz;
     if (total_sz > _buffer_size) {
         return FRAME_ERR_INSUFF_SPACE;
     }
 
-    _buffer[FRAME_CHUNKS_FIELD] = total_sz / _chunk_size +
-                                    ((total_sz % _chunk_size > 0)?1:0);
-
-    unsigned int ctrl_type = htonl(ctrl->_type);
-    memcpy(&_buffer[CTRL_FRAME_TYPE_FIELD], &ctrl_type, sizeof(ctrl_type));
+    _buffer[FRAME_CHUNKS_FIELD] = (_max_chunks == 1) ? 1 :
+                                  (total_sz + _chunk_size - 1) / _chunk_size;
+    store_be32(&_buffer[CTRL_FRAME_TYPE_FIELD], ctrl->_type);
 
     /* Copying specific parameters */
-    unsigned int k_min;
-    unsigned int ts_rate;
-    switch (ctrl->_type) {
-        case FRAME_CTRL_TYPE_HELLO:
-            k_min = htonl(ctrl->_k_min);
-            memcpy(&_buffer[CTRL_FRAME_HEADER_SIZE], &k_min, sizeof(k_min));
-        break;
-        case FRAME_CTRL_TYPE_TS_RATE:
-            ts_rate = htonl(ctrl->_ts_rate);
-            memcpy(&_buffer[CTRL_FRAME_HEADER_SIZE], &ts_rate, sizeof(ts_rate));
+    if (ctrl->_type == FRAME_CTRL_TYPE_HELLO) {
+        store_be32(&_buffer[CTRL_FRAME_PARAM_FIELD], ctrl->_k_min);
+    } else if (ctrl->_type == FRAME_CTRL_TYPE_TS_RATE) {
+        store_be32(&_buffer[CTRL_FRAME_PARAM_FIELD], ctrl->_ts_rate);
     }
 
     return FRAME_OK;
@@ -474,45 +571,16 @@ int Frame::getCtrlFrameData(FrameControlFields &ctrl)
         return FRAME_ERR_WRONG_FRAME_TYPE;
     }
 
-    unsigned int ctrl_type_raw;
-    memcpy((char*)&ctrl_type_raw, &_buffer[CTRL_FRAME_TYPE_FIELD], sizeof(ctrl_type_raw));
-    unsigned int ctrl_type = ntohl(ctrl_type_raw);
-
-    switch (ctrl_type) {
-        case FRAME_CTRL_TYPE_HELLO:
-            ctrl._type = FRAME_CTRL_TYPE_HELLO;
-
-            unsigned int k_min_raw;
-            memcpy((char*)&k_min_raw, &_buffer[CTRL_FRAME_HEADER_SIZE], sizeof(k_min_raw));
-            ctrl._k_min = ntohl(k_min_raw);
-
-            break;
-
-        case FRAME_CTRL_TYPE_TS_RATE:
-            ctrl._type = FRAME_CTRL_TYPE_TS_RATE;
-
-            unsigned int ts_rate;
-            memcpy((char*)&ts_rate, &_buffer[CTRL_FRAME_HEADER_SIZE], sizeof(ts_rate));
-            ctrl._ts_rate = ntohl(ts_rate);
-
-            break;
-
-        case FRAME_CTRL_TYPE_HELLO_OK:
-        case FRAME_CTRL_TYPE_ACTIVE:
-        case FRAME_CTRL_TYPE_WAIT:
-        case FRAME_CTRL_TYPE_CHANGE:
-        case FRAME_CTRL_TYPE_CHANGE_OK:
-        case FRAME_CTRL_TYPE_INACTIVE:
-        case FRAME_CTRL_TYPE_SHUT:
-        case FRAME_CTRL_TYPE_SHUT_OK:
-        case FRAME_CTRL_TYPE_ERR_HELLO:
-        case FRAME_CTRL_TYPE_ERR_ACTIVE:
-        case FRAME_CTRL_TYPE_ERR_INACTIVE:
-            ctrl._type = ctrl_type;
-            break;
-        default:
-            return FRAME_ERR_WRONG_CTRL_TYPE;
+    //HELLO and TS_RATE share the parameter field, every other field is kept
+    int ctrl_type = (int) load_be32(&_buffer[CTRL_FRAME_TYPE_FIELD]);
+    if (ctrl_type == FRAME_CTRL_TYPE_HELLO) {
+        ctrl._k_min = load_be32(&_buffer[CTRL_FRAME_PARAM_FIELD]);
+    } else if (ctrl_type == FRAME_CTRL_TYPE_TS_RATE) {
+        ctrl._ts_rate = load_be32(&_buffer[CTRL_FRAME_PARAM_FIELD]);
+    } else if (ctrl_param_size(ctrl_type) < 0) {
+        return FRAME_ERR_WRONG_CTRL_TYPE;
     }
+    ctrl._type = ctrl_type;
 
     return FRAME_OK;
 }
@@ -1,6 +1,7 @@
 #ifndef FRAME_HH
 #define FRAME_HH
 
+#include <atomic>
 #include "common/Common.hh"
 
 #define FRAME_OK                    (0)
@@ -30,11 +31,20 @@
 #define FRAME_CTRL_TYPE_SHUT_OK      (9)
 #define FRAME_CTRL_TYPE_TS_RATE      (10)
 
+/* Coalescing state of a data frame: the producer may append to an OPEN frame,
+is appending to an APPENDING one, and leaves SEALED frames to the traffic
+shaper. Frames are SEALED unless the producer opens them. */
+#define FRAME_SEAL_OPEN         (0)
+#define FRAME_SEAL_APPENDING    (1)
+#define FRAME_SEAL_SEALED       (2)
+
 #define FRAME_CTRL_TYPE_ERR_HELLO    (-1)
 #define FRAME_CTRL_TYPE_ERR_ACTIVE   (-2)
 #define FRAME_CTRL_TYPE_ERR_INACTIVE (-3)
 
 
+class FramePool;
+
 struct FrameControlFields {
     int _type;
     unsigned int _k_min;
@@ -48,6 +58,10 @@ class Frame {
 
         Frame(int max_chunks, int chunk_size);
 
+        /* Frame over a zeroed buffer of max_chunks * chunk_size bytes owned by
+         * the caller, such as a FramePool slab */
+        Frame(int max_chunks, int chunk_size, char *buffer);
+
         ~Frame();
 
         int getChunkSize();
@@ -79,10 +93,32 @@ class Frame {
 
         int getDataFrameData(char *(&data_ptr), int &data_sz);
 
-        int getDataFrameSpace(char *(&data_ptr), int &space_sz);
+        /* Space for data in the first `chunks` chunks of a data frame, in all
+        of them when -1 */
+        int getDataFrameSpace(char *(&data_ptr), int &space_sz, int chunks = -1);
 
         int setDataFrameSize(int data_sz);
 
+        /* Free space after the data already in a data frame, within its
+        first `chunks` chunks as above */
+        int getDataFrameTail(char *(&tail_ptr), int &free_sz, int chunks = -1);
+
+        /* Producer side of coalescing: unseal() opens a queued data frame for
+         * appends, beginAppend() claims it unless the consumer sealed it and
+         * endAppend() gives it back, sealing it when no more data fits. The
+         * consumer seal()s a frame before sending its first chunk; seal() only
+         * fails while an append is in progress. */
+        void unseal();
+
+        bool beginAppend();
+
+        void endAppend(bool seal);
+
+        bool seal();
+
+        /* Padding bytes of a chaff frame, everything after the header */
+        int getChaffFrameSpace(char *(&chaff_ptr), int &chaff_sz);
+
         int setChaffFrameData();
 
         int setCtrlFrameData(FrameControlFields *ctrl);
@@ -95,6 +131,22 @@ class Frame {
         int _buffer_size;
         int _max_chunks;
         int _chunk_size;
+        bool _own_buffer;
+
+        int capacity(int chunks);
+
+        std::atomic<int> _seal{FRAME_SEAL_SEALED};
+
+        /* Pool bookkeeping: the owner pool, the index of the frame in it, the
+         * free-list link (index + 1, 0 ends the list), the ownership bits
+         * set while the frame is allocated and the holders of a shared
+         * frame. */
+        friend class FramePool;
+        FramePool *_pool_owner = nullptr;
+        unsigned int _pool_index = 0;
+        std::atomic<unsigned int> _pool_next{0};
+        std::atomic<unsigned int> _pool_flags{0};
+        std::atomic<int> _pool_refs{0};
 };
 
 #endif //FRAME_HH
@@ -1,137 +1,314 @@
+#include <sys/mman.h>
 #include "FramePool.hh"
 
-FramePool::FramePool(int pool_size, int max_chunks, int chunk_size)
+#define FRAME_POOL_INDEX_MASK   (0xffffffffull)
+#define FRAME_POOL_ALIGN        (64)
+#define FRAME_POOL_HUGEPAGE_SZ  (2 * 1024 * 1024)
+
+#define ALIGN_UP(x, a)          (((x) + (a) - 1) / (a) * (a))
+
+/* Slot of the calling thread in the magazines of every pool */
+static std::atomic<int> next_thread_slot(0);
+static thread_local int thread_slot = -1;
+
+FramePool::FramePool(int pool_size, int max_chunks, int chunk_size) :
+    _pool_size(0), _free_head(0), _allocs(0), _frees(0)
 {
     assert(pool_size > 0 && pool_size <= FRAME_POOL_MAX_FRAMES);
 
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-
-    _pool_size = pool_size;
     _max_chunks = max_chunks;
     _chunk_size = chunk_size;
 
-    for (int i = 0; i < _pool_size; i++) {
-        _unalloc_frames.push(new Frame(_max_chunks, _chunk_size));
+    _header_size = ALIGN_UP(sizeof(Frame), FRAME_POOL_ALIGN);
+    _stride = _header_size + ALIGN_UP((size_t) max_chunks * chunk_size, FRAME_POOL_ALIGN);
+    _slab_size = ALIGN_UP(_stride * FRAME_POOL_MAX_FRAMES, FRAME_POOL_HUGEPAGE_SZ);
+
+    //huge pages are reserved for the whole slab up front, or mmap() fails
+    //instead of faulting later when the system runs out of them
+    _slab = (char *) MAP_FAILED;
+    #if FRAME_POOL_HUGEPAGES
+        _slab = (char *) mmap(NULL, _slab_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    #endif
+
+    //otherwise only the pages of frames in use are committed
+    if (_slab == MAP_FAILED) {
+        _slab = (char *) mmap(NULL, _slab_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (_slab == MAP_FAILED) {
+            std::cerr << "[TORK]: Fatal error: frame pool mmap()" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        #if FRAME_POOL_HUGEPAGES
+            madvise(_slab, _slab_size, MADV_HUGEPAGE);
+        #endif
     }
 
-    assert(_unalloc_frames.size() == _pool_size);
+    std::unique_lock<std::mutex> grow_lock(_grow_mtx);
+    add_frames(pool_size);
 
+    assert(_pool_size == pool_size);
 }
 
 FramePool::~FramePool()
 {
+    std::unique_lock<std::mutex> grow_lock(_grow_mtx);
+
+    for (int i = 0; i < _pool_size; i++) {
+        frame_at(i)->~Frame();
+    }
+    munmap(_slab, _slab_size);
+}
+
+Frame* FramePool::frame_at(unsigned int index)
+{
+    return (Frame *) (_slab + index * _stride);
+}
+
+FramePoolMagazine* FramePool::magazine()
+{
+    if (thread_slot == -1) {
+        thread_slot = next_thread_slot++;
+    }
+    return (thread_slot < FRAME_POOL_MAX_THREADS) ? &_magazines[thread_slot] : nullptr;
+}
+
+bool FramePool::pop(unsigned int &index)
+{
+    unsigned long long head = _free_head.load(std::memory_order_acquire);
+    unsigned long long new_head;
+    unsigned int top, next;
+
+    do {
+        top = head & FRAME_POOL_INDEX_MASK;
+        if (top == 0) {
+            return false;
+        }
+        next = frame_at(top - 1)->_pool_next.load(std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | next;
+    } while (!_free_head.compare_exchange_weak(head, new_head,
+                                               std::memory_order_acq_rel,
+                                               std::memory_order_acquire));
+
+    index = top - 1;
+    return true;
+}
+
+/* Pushes the chain first -> ... -> last, already linked through _pool_next */
+void FramePool::push(unsigned int first, unsigned int last)
+{
+    unsigned long long head = _free_head.load(std::memory_order_relaxed);
+    unsigned long long new_head;
+
+    do {
+        frame_at(last)->_pool_next.store(head & FRAME_POOL_INDEX_MASK,
+                                        std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | (first + 1);
+    } while (!_free_head.compare_exchange_weak(head, new_head,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+/* Called with the grow mutex held */
+void FramePool::add_frames(int how_many)
+{
+    int first = _pool_size;
     Frame *frame;
 
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
+    for (int i = first; i < first + how_many; i++) {
+        frame = new (frame_at(i)) Frame(_max_chunks, _chunk_size,
+                                        (char *) frame_at(i) + _header_size);
+        frame->_pool_owner = this;
+        frame->_pool_index = i;
+        frame->_pool_next.store(i + 2, std::memory_order_relaxed);
+    }
+
+    #if FRAME_POOL_MLOCK
+        if (mlock(frame_at(first), how_many * _stride) != 0) {
+            std::cerr << "[TORK]: Could not mlock() the frame pool" << std::endl;
+        }
+    #endif
 
-    while (!_unalloc_frames.empty()) {
-        frame = _unalloc_frames.front();
-        _unalloc_frames.pop();
-        delete frame;
+    _pool_size = first + how_many;
+    push(first, first + how_many - 1);
+}
+
+int FramePool::grow()
+{
+    int more_frames;
+    std::unique_lock<std::mutex> grow_lock(_grow_mtx);
+
+    //another thread grew the pool meanwhile
+    if ((_free_head.load(std::memory_order_acquire) & FRAME_POOL_INDEX_MASK) != 0) {
+        return FRAME_POOL_OK;
+    }
+
+    if (_pool_size >= FRAME_POOL_MAX_FRAMES) {
+        return FRAME_POOL_ERR_FULL;
     }
 
-    for (std::set<Frame*>::iterator it = _alloc_frames.begin(); it != _alloc_frames.end(); ++it) {
-        delete *it;
+    if (_pool_size * 2 <= FRAME_POOL_MAX_FRAMES) {
+        more_frames = _pool_size;
+    } else {
+        more_frames = FRAME_POOL_MAX_FRAMES - _pool_size;
     }
+
+    add_frames(more_frames);
+    return FRAME_POOL_OK;
 }
 
 int FramePool::getNumAllocFrames()
 {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    return _alloc_frames.size();
+    long total = _allocs - _frees;
+    for (int i = 0; i < FRAME_POOL_MAX_THREADS; i++) {
+        total += _magazines[i]._allocs - _magazines[i]._frees;
+    }
+    return total;
 }
 
 int FramePool::getNumUnallocFrames()
 {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-    return _unalloc_frames.size();
+    return _pool_size - getNumAllocFrames();
 }
 
 int FramePool::allocFrame(Frame*(&frame))
 {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-
-    if (_unalloc_frames.size() == 0) {
-        int more_frames;
-        if (_pool_size < FRAME_POOL_MAX_FRAMES) {
-            if (_pool_size * 2 <= FRAME_POOL_MAX_FRAMES) {
-                more_frames = _pool_size;
-                _pool_size = _pool_size * 2;
-
-            } else {
-                more_frames = FRAME_POOL_MAX_FRAMES - _pool_size;
-                _pool_size = FRAME_POOL_MAX_FRAMES;
+    unsigned int index;
+    FramePoolMagazine *mag = magazine();
 
+    if (mag != nullptr) {
+        //refill half of the magazine from the shared free list
+        while (mag->_count == 0) {
+            while (mag->_count < FRAME_POOL_MAGAZINE / 2 && pop(index)) {
+                mag->_frames[mag->_count++] = index;
             }
-
-            for (int i = 0; i < more_frames; i++) {
-                _unalloc_frames.push(new Frame(_max_chunks, _chunk_size));
+            if (mag->_count == 0 && grow() != FRAME_POOL_OK) {
+                return FRAME_POOL_ERR_FULL;
+            }
+        }
+        index = mag->_frames[--mag->_count];
+        mag->_allocs.store(mag->_allocs.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+    } else {
+        while (!pop(index)) {
+            if (grow() != FRAME_POOL_OK) {
+                return FRAME_POOL_ERR_FULL;
             }
-        } else {
-            return FRAME_POOL_ERR_FULL;
         }
+        _allocs.fetch_add(1, std::memory_order_relaxed);
     }
 
-    frame = _unalloc_frames.front();
-    _unalloc_frames.pop();
-    _alloc_frames.insert(frame);
+    frame = frame_at(index);
+    frame->_pool_flags.store(FRAME_POOL_FLAG_ALLOC, std::memory_order_relaxed);
+    frame->_seal.store(FRAME_SEAL_SEALED, std::memory_order_relaxed);
 
     return FRAME_POOL_OK;
 }
 
+void FramePool::shareFrame(Frame *frame)
+{
+    assert(frame->_pool_owner == this &&
+           (frame->_pool_flags.load(std::memory_order_relaxed) & FRAME_POOL_FLAG_ALLOC));
+
+    frame->_pool_refs.store(1, std::memory_order_relaxed);
+    frame->_pool_flags.fetch_or(FRAME_POOL_FLAG_SHARED, std::memory_order_release);
+}
+
+void FramePool::retainFrame(Frame *frame)
+{
+    assert(frame->_pool_flags.load(std::memory_order_relaxed) & FRAME_POOL_FLAG_SHARED);
+    frame->_pool_refs.fetch_add(1, std::memory_order_relaxed);
+}
+
 int FramePool::unallocFrame(Frame*(& frame))
 {
     assert(frame != nullptr);
 
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-    if (_alloc_frames.find(frame) == _alloc_frames.end()) {
+    //shared frames are only freed by their last holder, into their own pool
+    if (frame->_pool_owner != nullptr &&
+        (frame->_pool_flags.load(std::memory_order_acquire) & FRAME_POOL_FLAG_SHARED)) {
+        if (frame->_pool_refs.fetch_sub(1, std::memory_order_acq_rel) > 1) {
+            return FRAME_POOL_OK;
+        }
+        frame->_pool_flags.fetch_and(~FRAME_POOL_FLAG_SHARED, std::memory_order_relaxed);
+        if (frame->_pool_owner != this) {
+            return frame->_pool_owner->unallocFrame(frame);
+        }
+    }
+
+    //frames of other pools and frames that are not allocated are rejected
+    if (frame->_pool_owner != this ||
+        !(frame->_pool_flags.fetch_and(~FRAME_POOL_FLAG_ALLOC,
+                                       std::memory_order_acq_rel) & FRAME_POOL_FLAG_ALLOC)) {
         return FRAME_POOL_ERR_INVALID;
     }
-    _alloc_frames.erase(frame);
-    _unalloc_frames.push(frame);
+
+    FramePoolMagazine *mag = magazine();
+
+    if (mag != nullptr) {
+        //return the upper half of a full magazine to the shared free list
+        if (mag->_count == FRAME_POOL_MAGAZINE) {
+            int first = FRAME_POOL_MAGAZINE / 2;
+            for (int i = first; i < FRAME_POOL_MAGAZINE - 1; i++) {
+                frame_at(mag->_frames[i])->_pool_next.store(mag->_frames[i + 1] + 1,
+                                                           std::memory_order_relaxed);
+            }
+            push(mag->_frames[first], mag->_frames[FRAME_POOL_MAGAZINE - 1]);
+            mag->_count = first;
+        }
+        mag->_frames[mag->_count++] = frame->_pool_index;
+        mag->_frees.store(mag->_frees.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+    } else {
+        push(frame->_pool_index, frame->_pool_index);
+        _frees.fetch_add(1, std::memory_order_relaxed);
+    }
 
     return FRAME_POOL_OK;
 }
 
 void FramePool::printFramePoolInfo(std::ostream &out)
 {
-    std::string state;
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+    std::unique_lock<std::mutex> grow_lock(_grow_mtx);
 
     out << " ************************** FRAME POOL ************************** " << std::endl;
     out << "Alloc Frames " << "("
-        << _alloc_frames.size()   << ") " << std::endl;
+        << getNumAllocFrames()   << ") " << std::endl;
 
-    for (std::set<Frame*>::iterator it = _alloc_frames.begin(); it != _alloc_frames.end(); ++it) {
-        out << " ================ Frame ================ "
-            << std::endl;
-        (*it)->printFrameInfo(out);
-        out << std::endl;
+    for (int i = 0; i < _pool_size; i++) {
+        if (frame_at(i)->_pool_flags & FRAME_POOL_FLAG_ALLOC) {
+            out << " ================ Frame ================ "
+                << std::endl;
+            frame_at(i)->printFrameInfo(out);
+            out << std::endl;
+        }
     }
 
     out << "Unalloc Frames " << "("
-        << _unalloc_frames.size()   << ") " << std::endl;
+        << getNumUnallocFrames()   << ") " << std::endl;
 }
 
 void FramePool::dumpFramePoolFrames(std::ostream &out)
 {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+    std::unique_lock<std::mutex> grow_lock(_grow_mtx);
+
     out << " ************************** FRAME POOL ************************** " << std::endl;
     out << "Alloc Frames " << "("
-        << _alloc_frames.size()   << ") " << std::endl;
+        << getNumAllocFrames()   << ") " << std::endl;
 
-    for (std::set<Frame*>::iterator it = _alloc_frames.begin(); it != _alloc_frames.end(); ++it) {
-        out << " ================ Frame ================ "
-            << std::endl;
-        (*it)->dumpFrame(out);
-        out << std::endl;
+    for (int i = 0; i < _pool_size; i++) {
+        if (frame_at(i)->_pool_flags & FRAME_POOL_FLAG_ALLOC) {
+            out << " ================ Frame ================ "
+                << std::endl;
+            frame_at(i)->dumpFrame(out);
+            out << std::endl;
+        }
     }
 
     out << "Unalloc Frames " << std::endl << "("
-        << _unalloc_frames.size()   << ") " << std::endl;
+        << getNumUnallocFrames()   << ") " << std::endl;
 }
 
 int FramePool::size() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
     return _pool_size;
 }
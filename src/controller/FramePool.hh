@@ -3,16 +3,39 @@
 
 #include "Frame.hh"
 #include "FdPair.hh"
-#include <queue>
-#include <set>
+#include <atomic>
+#include <mutex>
 
 #define FRAME_POOL_MAX_FRAMES   (30000)
 
+/* Threads that get a private magazine in each pool, later threads go straight
+to the shared free list */
+#define FRAME_POOL_MAX_THREADS  (64)
+
+/* Frames cached per thread; half of them move at once between a magazine and
+the shared free list */
+#define FRAME_POOL_MAGAZINE     (32)
+
 #define FRAME_POOL_OK           (0)
 
 #define FRAME_POOL_ERR_FULL               (-1)
 #define FRAME_POOL_ERR_INVALID            (-2)
 
+/* Set in Frame::_pool_flags while the frame is allocated */
+#define FRAME_POOL_FLAG_ALLOC   (1u)
+
+/* Set in Frame::_pool_flags while an allocated frame is shared */
+#define FRAME_POOL_FLAG_SHARED  (2u)
+
+/* Frames cached by one thread. Only the owner thread touches _frames and
+ * _count; the counters are read by the statistics. */
+struct alignas(64) FramePoolMagazine {
+    unsigned int _frames[FRAME_POOL_MAGAZINE];
+    int _count = 0;
+    std::atomic<long> _allocs{0};
+    std::atomic<long> _frees{0};
+};
+
 class FramePool {
 
     public:
@@ -28,6 +51,15 @@ class FramePool {
 
         int unallocFrame(Frame*(& frame));
 
+        /* Makes an allocated frame read-only and shared, the caller holding
+        the first reference. Each holder gives its reference back with
+        unallocFrame() on any pool; the last one returns the frame to its
+        own pool. */
+        void shareFrame(Frame *frame);
+
+        /* Adds a holder to a shared frame */
+        void retainFrame(Frame *frame);
+
         void printFramePoolInfo(std::ostream &out = std::cout);
 
         void dumpFramePoolFrames(std::ostream &out = std::cout);
@@ -35,13 +67,42 @@ class FramePool {
         int size();
 
     private:
-        int _pool_size;
+        FramePoolMagazine* magazine();
+
+        bool pop(unsigned int &index);
+
+        void push(unsigned int first, unsigned int last);
+
+        int grow();
+
+        void add_frames(int how_many);
+
+        Frame* frame_at(unsigned int index);
+
         int _max_chunks;
         int _chunk_size;
-        std::queue<Frame*> _unalloc_frames;
-        std::set<Frame*> _alloc_frames;
 
-        std::shared_mutex _mtx;
+        /* Address space for FRAME_POOL_MAX_FRAMES frames, reserved up front
+        and committed as the pool grows. Frame i sits at i * _stride with its
+        payload _header_size bytes after it, both cache-line aligned, so
+        lock-free readers can index it while grow() appends. */
+        char *_slab;
+        size_t _slab_size;
+        size_t _stride;
+        size_t _header_size;
+        std::atomic<int> _pool_size;
+
+        /* Treiber stack of free frames: ABA tag in the high 32 bits and the
+        index + 1 of the top frame in the low 32 bits (0 when empty) */
+        std::atomic<unsigned long long> _free_head;
+
+        FramePoolMagazine _magazines[FRAME_POOL_MAX_THREADS];
+
+        /* Allocations of threads without a magazine */
+        std::atomic<long> _allocs;
+        std::atomic<long> _frees;
+
+        std::mutex _grow_mtx;
 
 };
 
@@ -1,46 +1,100 @@
 #include "FrameQueue.hh"
 
-FrameQueue::FrameQueue() : _last_chunk(0) {}
+#define FRAME_QUEUE_RING_MASK   (FRAME_QUEUE_RING_SIZE - 1)
+
+FrameQueue::FrameQueue(int mode) : _head(0), _tail_cache(0), _last_chunk(0),
+    _tail(0), _head_cache(0), _overflow_size(0),
+    _multi_producer(mode == FRAME_QUEUE_MULTI_PRODUCER) {}
 
 void FrameQueue::push(Frame* frame) {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
+    std::unique_lock<std::mutex> producer_lock(_producer_mtx, std::defer_lock);
+    if (_multi_producer) {
+        producer_lock.lock();
+    }
+
+    unsigned int tail = _tail.load(std::memory_order_relaxed);
 
-    _queue.push(frame);
+    if (_overflow_size.load(std::memory_order_acquire) == 0) {
+        if (tail - _head_cache == FRAME_QUEUE_RING_SIZE) {
+            _head_cache = _head.load(std::memory_order_acquire);
+        }
+        if (tail - _head_cache < FRAME_QUEUE_RING_SIZE) {
+            _ring[tail & FRAME_QUEUE_RING_MASK] = frame;
+            _tail.store(tail + 1, std::memory_order_release);
+            return;
+        }
+    }
+
+    std::unique_lock<std::mutex> overflow_lock(_overflow_mtx);
+    _overflow.push(frame);
+    _overflow_size++;
 }
 
-void FrameQueue::pop() {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
+bool FrameQueue::ring_empty() {
+    unsigned int head = _head.load(std::memory_order_relaxed);
+    if (head == _tail_cache) {
+        _tail_cache = _tail.load(std::memory_order_acquire);
+    }
+    return head == _tail_cache;
+}
 
+void FrameQueue::pop() {
     _last_chunk = 0;
-    _queue.pop();
+
+    if (!ring_empty()) {
+        _head.store(_head.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+        return;
+    }
+
+    std::unique_lock<std::mutex> overflow_lock(_overflow_mtx);
+    if (!_overflow.empty()) {
+        _overflow.pop();
+        _overflow_size--;
+    }
 }
 
 Frame* FrameQueue::getFrame() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+    if (!ring_empty()) {
+        return _ring[_head.load(std::memory_order_relaxed) & FRAME_QUEUE_RING_MASK];
+    }
 
-    return _queue.front();
+    std::unique_lock<std::mutex> overflow_lock(_overflow_mtx);
+    return _overflow.empty() ? nullptr : _overflow.front();
 }
 
-bool FrameQueue::empty() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+Frame* FrameQueue::back() {
+    assert(!_multi_producer);
+
+    //once frames overflow every later push goes to the overflow queue, so the
+    //last frame pushed is there until the consumer drains it
+    if (_overflow_size.load(std::memory_order_acquire) > 0) {
+        std::unique_lock<std::mutex> overflow_lock(_overflow_mtx);
+        return _overflow.empty() ? nullptr : _overflow.back();
+    }
+
+    unsigned int tail = _tail.load(std::memory_order_relaxed);
+    if (_head.load(std::memory_order_acquire) == tail) {
+        return nullptr;
+    }
+    return _ring[(tail - 1) & FRAME_QUEUE_RING_MASK];
+}
 
-    return _queue.empty();
+bool FrameQueue::empty() {
+    return ring_empty() && _overflow_size.load(std::memory_order_acquire) == 0;
 }
 
 int FrameQueue::size() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
+    unsigned int head = _head.load(std::memory_order_acquire);
+    unsigned int tail = _tail.load(std::memory_order_acquire);
 
-    return _queue.size();
+    return (tail - head) + _overflow_size.load(std::memory_order_acquire);
 }
 
 int FrameQueue::getLastChunk() {
-    std::shared_lock<std::shared_mutex> res_lock(_mtx);
-
     return _last_chunk;
 }
 
 void FrameQueue::setLastChunk(int chunk) {
-    std::unique_lock<std::shared_mutex> res_lock(_mtx);
-
     _last_chunk = chunk;
-}
\ No newline at end of file
+}
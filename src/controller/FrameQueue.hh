@@ -3,11 +3,26 @@
 
 #include "Frame.hh"
 #include <queue>
+#include <atomic>
+#include <mutex>
 
+/* Frames held by the lock-free ring of a queue (power of two). Further frames
+wait in a locked overflow queue. */
+#define FRAME_QUEUE_RING_SIZE       (256)
+
+/* One producer thread and one consumer thread at a time */
+#define FRAME_QUEUE_SPSC            (0)
+
+/* Several threads may push concurrently, push() serializes them */
+#define FRAME_QUEUE_MULTI_PRODUCER  (1)
+
+/* Single-producer single-consumer queue of frames. The producer calls push(),
+ * the consumer calls every other method but size(), which any thread may use
+ * for statistics. */
 class FrameQueue {
 
     public:
-        FrameQueue();
+        FrameQueue(int mode = FRAME_QUEUE_SPSC);
 
         ~FrameQueue() {}
 
@@ -17,6 +32,11 @@ class FrameQueue {
 
         Frame* getFrame();
 
+        /* Last frame pushed if the consumer has not popped it yet, for the
+        producer of a single producer queue. The consumer may pop it at any
+        time after, so only sealed frames can be popped. */
+        Frame* back();
+
         bool empty();
 
         int size();
@@ -26,12 +46,28 @@ class FrameQueue {
         void setLastChunk(int chunk);
 
     private:
-        std::queue<Frame*> _queue;
+        bool ring_empty();
 
+        Frame* _ring[FRAME_QUEUE_RING_SIZE];
+
+        /* Consumer side: next frame to read and last tail it observed */
+        alignas(64) std::atomic<unsigned int> _head;
+        unsigned int _tail_cache;
         int _last_chunk;
 
-        std::shared_mutex _mtx;
+        /* Producer side: next free slot and last head it observed */
+        alignas(64) std::atomic<unsigned int> _tail;
+        unsigned int _head_cache;
+
+        /* Frames pushed while the ring was full, and every frame after them
+        until the consumer drains it, so that order is kept */
+        alignas(64) std::queue<Frame*> _overflow;
+        std::atomic<int> _overflow_size;
+        std::mutex _overflow_mtx;
+
+        bool _multi_producer;
+        std::mutex _producer_mtx;
 
 };
 
-#endif /* FRAME_QUEUE_HH */
\ No newline at end of file
+#endif /* FRAME_QUEUE_HH */
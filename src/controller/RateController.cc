@@ -0,0 +1,58 @@
+#include "RateController.hh"
+#include <stdlib.h>
+
+unsigned int LinearRateController::update(const RateSample &sample,
+                                          unsigned int rate)
+{
+    if (sample._clients == 0) {
+        return rate;
+    }
+    return clamp((long) sample._clients * _min_rate);
+}
+
+unsigned int AdaptiveRateController::update(const RateSample &sample,
+                                            unsigned int rate)
+{
+    int want = 0;
+    long next;
+
+    //connection changes carry no measurements, only keep the rate in range
+    if (sample._clients == 0 || sample._ticks == 0) {
+        return clamp(rate);
+    }
+
+    double backlog = (double) sample._data_frames / sample._clients;
+    double chaff = (sample._chunks == 0) ? 1.0 :
+                   (double) sample._chaff_chunks / sample._chunks;
+    double overruns = (double) sample._overruns / sample._ticks;
+
+    if (overruns > TS_RATE_MAX_OVERRUN) {
+        want = 1;
+    } else if (backlog >= TS_RATE_HIGH_BACKLOG) {
+        want = -1;
+    } else if (chaff >= TS_RATE_HIGH_CHAFF && sample._data_frames == 0) {
+        want = 1;
+    }
+
+    //samples between the thresholds or changing direction start over
+    if (want == 0 || (_pressure != 0 && (want > 0) != (_pressure > 0))) {
+        _pressure = want;
+    } else {
+        _pressure += want;
+    }
+
+    if (abs(_pressure) < TS_RATE_HOLD) {
+        return rate;
+    }
+    _pressure = 0;
+
+    next = clamp((long) rate * (100 + want * TS_RATE_STEP) / 100);
+
+    //small moves are not worth a TS_RATE to every client, unless they reach
+    //the end of the range
+    if (labs(next - (long) rate) * 100 < (long) rate * TS_RATE_MIN_CHANGE &&
+        next != _min_rate && next != _max_rate) {
+        return rate;
+    }
+    return next;
+}
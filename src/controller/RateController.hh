@@ -0,0 +1,97 @@
+#ifndef RATE_CONTROLLER_HH
+#define RATE_CONTROLLER_HH
+
+#include "../common/Common.hh"
+
+#define TS_RATE_CONTROL_LINEAR      (1)
+#define TS_RATE_CONTROL_ADAPTIVE    (2)
+
+#define TS_VALID_RATE_CONTROL(c)    (c == TS_RATE_CONTROL_LINEAR || \
+                                     c == TS_RATE_CONTROL_ADAPTIVE)
+
+/* Queued data frames per client above which the adaptive controller speeds up
+the traffic shaper */
+#define TS_RATE_HIGH_BACKLOG        (2.0)
+
+/* Share of chaff among the chunks sent above which an idle bridge slows the
+traffic shaper down */
+#define TS_RATE_HIGH_CHAFF          (0.9)
+
+/* Share of overrun ticks above which the bridge cannot keep up with the rate
+and slows it down regardless of the backlog */
+#define TS_RATE_MAX_OVERRUN         (0.05)
+
+/* Consecutive samples that must agree before the rate moves */
+#define TS_RATE_HOLD                (3)
+
+/* Relative change of the rate per move, and smallest change worth ordering
+to the clients (percent) */
+#define TS_RATE_STEP                (25)
+#define TS_RATE_MIN_CHANGE          (5)
+
+/* What the bridge observed between two rate updates */
+struct RateSample {
+    int _clients = 0;
+    int _data_frames = 0;
+    long _chunks = 0;
+    long _chaff_chunks = 0;
+    long _ticks = 0;
+    long _overruns = 0;
+};
+
+/* Chooses the traffic shaper period (microseconds) of the bridge and its
+ * clients. update() is called on every connection change, with no ticks in
+ * the sample, and periodically from the traffic shaper. */
+class RateController {
+
+    public:
+        RateController(unsigned int min_rate, unsigned int max_rate) :
+            _min_rate(min_rate), _max_rate(max_rate) {}
+
+        virtual ~RateController() {}
+
+        virtual unsigned int update(const RateSample &sample,
+                                    unsigned int rate) = 0;
+
+    protected:
+        unsigned int clamp(long rate) {
+            if (rate < _min_rate) return _min_rate;
+            if (rate > _max_rate) return _max_rate;
+            return rate;
+        }
+
+        unsigned int _min_rate;
+        unsigned int _max_rate;
+};
+
+/* Period proportional to the number of clients */
+class LinearRateController : public RateController {
+
+    public:
+        LinearRateController(unsigned int min_rate, unsigned int max_rate) :
+            RateController(min_rate, max_rate) {}
+
+        unsigned int update(const RateSample &sample, unsigned int rate);
+};
+
+/* Period driven by the data queued for the clients, the share of chaff sent
+ * and the overruns of the traffic shaper */
+class AdaptiveRateController : public RateController {
+
+    public:
+        AdaptiveRateController(unsigned int min_rate, unsigned int max_rate) :
+            RateController(min_rate, max_rate) {}
+
+        unsigned int update(const RateSample &sample, unsigned int rate);
+
+        int getPressure() {
+            return _pressure;
+        }
+
+    private:
+        /* Consecutive samples asking for a shorter (< 0) or longer (> 0)
+        period */
+        int _pressure = 0;
+};
+
+#endif /* RATE_CONTROLLER_HH */
@@ -1,11 +1,29 @@
 #include "TrafficShaper.hh"
 #include "../common/Common.hh"
+#include <errno.h>
+
+static void timespec_add_us(struct timespec &ts, long usec)
+{
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec += (usec % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+}
+
+/* a - b in microseconds */
+static long timespec_diff_us(const struct timespec &a, const struct timespec &b)
+{
+    return (a.tv_sec - b.tv_sec) * 1000000 + (a.tv_nsec - b.tv_nsec) / 1000;
+}
 
 TrafficShaper::TrafficShaper() {}
 
 int TrafficShaper::initialize(Controller *controller,
                               int rate_microsec, int strategy, int init_state,
-                              int run_mode) {
+                              int run_mode, int shards, int overrun,
+                              int burst) {
 
     assert(controller != nullptr);
     _controller = controller;
@@ -16,19 +34,36 @@ int TrafficShaper::initialize(Controller *controller,
     assert(TS_VALID_STRATEGY(strategy));
     _strategy = strategy;
 
+    assert(TS_VALID_OVERRUN(overrun));
+    _overrun = overrun;
+
+    assert(burst > 0 && burst <= TS_MAX_BURST);
+    _burst = (strategy == TS_STRATEGY_BURST) ? burst : 1;
+
     _state = init_state;
 
     _dist_expo = std::exponential_distribution<double>(
                     (double)20/(double)_rate_microsec);
 
+    assert(shards > 0);
+    _shards = shards;
+    _running = shards;
+    _stats.assign(shards, TrafficShaperStats());
+
     if (run_mode == RUN_BACKGROUND) {
-        std::thread th(&TrafficShaper::main_thread, this);
-        th.detach();
+        for (int shard = 0; shard < _shards; shard++) {
+            std::thread th(&TrafficShaper::main_thread, this, shard);
+            th.detach();
+        }
         return 0;
     }
 
     if (run_mode == RUN_FOREGROUND) {
-        main_thread();
+        for (int shard = 1; shard < _shards; shard++) {
+            std::thread th(&TrafficShaper::main_thread, this, shard);
+            th.detach();
+        }
+        main_thread(0);
         return 0;
     }
 
@@ -40,7 +75,7 @@ int TrafficShaper::terminate() {
         std::unique_lock<std::mutex> res_lock(_mtx);
         _state = TS_STATE_SHUTTING;
     }
-    _cv.notify_one();
+    _cv.notify_all();
 
     {
         std::unique_lock<std::mutex> res_lock(_mtx);
@@ -62,70 +97,108 @@ void TrafficShaper::on() {
         std::unique_lock<std::mutex> res_lock(_mtx);
         _state = TS_STATE_ON;
     }
-    _cv.notify_one();
+    _cv.notify_all();
 }
 
-void TrafficShaper::main_thread()
+void TrafficShaper::main_thread(int shard)
 {
     assert(_controller != nullptr);
-    int rate, adj_rate;
-    std::chrono::high_resolution_clock::time_point start, end;
-    std::chrono::duration<double> diff;
-
-    switch (_strategy) {
-        case TS_STRATEGY_CONSTANT:
-            while(true) {
-                {
-                    std::unique_lock<std::mutex> res_lock(_mtx);
-                    if (_state == TS_STATE_SHUTTING) {
-                        _state = TS_STATE_OFF;
-                        break;
-                    }
-
-                    while(_state == TS_STATE_IDLE) {
-                        _cv.wait(res_lock);
-                    }
-                    rate = _rate_microsec;
+    int rate;
+    long period = 0, late, missed;
+    bool resync = true;
+    struct timespec deadline, now, last_tick;
+
+    /* Random state is per thread, the ticks of the shards are independent */
+    std::default_random_engine generator(
+        std::default_random_engine::default_seed + shard);
+    std::exponential_distribution<double> dist_expo(_dist_expo);
+
+    while(true) {
+        {
+            std::unique_lock<std::mutex> res_lock(_mtx);
+            if (_state == TS_STATE_SHUTTING) {
+                if (--_running == 0) {
+                    _state = TS_STATE_OFF;
                 }
-                start = std::chrono::high_resolution_clock::now();
-                _controller->handleTrafficShapingEvent();
-                end = std::chrono::high_resolution_clock::now();
+                break;
+            }
 
-                diff = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                adj_rate = abs(rate - diff.count());
-                std::this_thread::sleep_for(std::chrono::microseconds(adj_rate));
+            while(_state == TS_STATE_IDLE) {
+                _cv.wait(res_lock);
+                resync = true;
             }
-        break;
-        case TS_STRATEGY_EXPONENT:
-            while(true) {
-                {
-                    std::unique_lock<std::mutex> res_lock(_mtx);
-                    if (_state == TS_STATE_SHUTTING) {
-                        _state = TS_STATE_OFF;
-                        break;
-                    }
-
-                    while(_state == TS_STATE_IDLE) {
-                        _cv.wait(res_lock);
-                    }
-                    rate = _rate_microsec;
-                }
-                start = std::chrono::high_resolution_clock::now();
-                _controller->handleTrafficShapingEvent();
-                end = std::chrono::high_resolution_clock::now();
+            rate = _rate_microsec;
+        }
+
+        //ticks after idle start a new grid, nothing was missed meanwhile
+        if (resync) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+        }
 
-                diff = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                adj_rate = abs(rate - diff.count());
-                std::this_thread::sleep_for(std::chrono::microseconds(
-                    std::lround(_dist_expo(_generator) + adj_rate)));
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                               NULL) == EINTR);
 
-            }
-        break;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!resync) {
+            record_tick(shard, timespec_diff_us(now, last_tick), period);
+        }
+        last_tick = now;
+        resync = false;
+
+        _controller->handleTrafficShapingEvent(shard);
+
+        period = rate;
+        if (_strategy == TS_STRATEGY_EXPONENT) {
+            period += std::lround(dist_expo(generator));
+        }
+        timespec_add_us(deadline, period);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late = timespec_diff_us(now, deadline);
+        if (late <= 0) {
+            continue;
+        }
+
+        //the deadline stays behind now so the next ticks do not sleep
+        missed = late / period + 1;
+        if (_overrun == TS_OVERRUN_CATCHUP) {
+            missed = (missed > TS_MAX_CATCHUP) ? missed - TS_MAX_CATCHUP : 0;
+        }
+        timespec_add_us(deadline, missed * period);
+
+        {
+            std::unique_lock<std::mutex> stats_lock(_stats_mtx);
+            _stats[shard]._overruns++;
+            _stats[shard]._skipped += missed;
+        }
+
+        #if (LOG_VERBOSE & LOG_BIT_TR_SHAPER)
+            std::cerr << "[Traffic Shaper] Shard " << shard << " overran by "
+                      << late << " us, skipped " << missed << " ticks"
+                      << std::endl;
+        #endif
     }
 
     _cv.notify_all();
 }
 
+void TrafficShaper::record_tick(int shard, long interval, long target)
+{
+    std::unique_lock<std::mutex> stats_lock(_stats_mtx);
+    TrafficShaperStats &stats = _stats[shard];
+
+    if (stats._ticks == 0 || interval < stats._interval_min) {
+        stats._interval_min = interval;
+    }
+    if (stats._ticks == 0 || interval > stats._interval_max) {
+        stats._interval_max = interval;
+    }
+    stats._ticks++;
+    stats._interval_sum += interval;
+    stats._target_sum += target;
+    stats._error_sum += labs(interval - target);
+}
+
 void TrafficShaper::setRate(int rate_microssec) {
     std::unique_lock<std::mutex> res_lock(_mtx);
     _rate_microsec = rate_microssec;
@@ -140,3 +213,25 @@ int TrafficShaper::getState() {
     std::unique_lock<std::mutex> res_lock(_mtx);
     return _state;
 }
+
+int TrafficShaper::getOverrun() {
+    return _overrun;
+}
+
+int TrafficShaper::getBurst() {
+    return _burst;
+}
+
+int TrafficShaper::getShards() {
+    return _shards;
+}
+
+TrafficShaperStats TrafficShaper::getStats(int shard) {
+    std::unique_lock<std::mutex> stats_lock(_stats_mtx);
+    return _stats[shard];
+}
+
+void TrafficShaper::clearStats() {
+    std::unique_lock<std::mutex> stats_lock(_stats_mtx);
+    _stats.assign(_shards, TrafficShaperStats());
+}
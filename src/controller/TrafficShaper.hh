@@ -5,19 +5,54 @@
 #include <thread>
 #include <chrono>
 #include <random>
+#include <vector>
+#include <time.h>
 
 #define TS_STRATEGY_CONSTANT    (1)
 #define TS_STRATEGY_EXPONENT    (2)
 
+/* Constant rate, sending a fixed number of chunks to every client per tick */
+#define TS_STRATEGY_BURST       (3)
+
 #define TS_STRATEGY_ERR         (-1)
 #define TS_VALID_STRATEGY(s)    (s == TS_STRATEGY_CONSTANT || \
-                                 s == TS_STRATEGY_EXPONENT)
+                                 s == TS_STRATEGY_EXPONENT || \
+                                 s == TS_STRATEGY_BURST)
+
+/* Maximum number of chunks per client and tick of TS_STRATEGY_BURST */
+#define TS_MAX_BURST            (64)
 
 #define TS_STATE_OFF       (0)
 #define TS_STATE_ON        (1)
 #define TS_STATE_IDLE      (2)
 #define TS_STATE_SHUTTING  (3)
 
+/* What a shard does when a tick ends past the deadline of the next one: run
+the missed ticks back to back (CATCHUP) or drop them and wait for the next
+deadline still ahead (SKIP). Either way deadlines stay on the same grid. */
+#define TS_OVERRUN_CATCHUP (1)
+#define TS_OVERRUN_SKIP    (2)
+
+#define TS_VALID_OVERRUN(o)     (o == TS_OVERRUN_CATCHUP || \
+                                 o == TS_OVERRUN_SKIP)
+
+/* Missed ticks a shard runs back to back under CATCHUP, those beyond it are
+skipped */
+#define TS_MAX_CATCHUP     (4)
+
+/* Achieved intervals between the starts of consecutive ticks of one shard,
+ * against the period it aimed for (microseconds) */
+struct TrafficShaperStats {
+    long _ticks = 0;
+    long _overruns = 0;
+    long _skipped = 0;
+    double _interval_sum = 0;
+    double _target_sum = 0;
+    double _error_sum = 0;
+    long _interval_min = 0;
+    long _interval_max = 0;
+};
+
 class TrafficShaper {
 
     public:
@@ -26,14 +61,15 @@ class TrafficShaper {
         virtual ~TrafficShaper(){};
 
         int initialize(Controller *controller, int rate_microsec, int strategy,
-                              int init_state, int run_mode);
+                              int init_state, int run_mode, int shards = 1,
+                              int overrun = TS_OVERRUN_SKIP, int burst = 1);
 
         int terminate();
 
         void idle();
         void on();
 
-        void main_thread();
+        void main_thread(int shard);
 
         void setRate(int rate_microssec);
 
@@ -41,17 +77,38 @@ class TrafficShaper {
 
         int getState();
 
+        int getOverrun();
+
+        int getBurst();
+
+        int getShards();
+
+        TrafficShaperStats getStats(int shard);
+
+        void clearStats();
+
     private:
+        void record_tick(int shard, long interval, long target);
         Controller* _controller = nullptr;
 
         int _rate_microsec;
 
         int _strategy;
 
-        std::default_random_engine _generator;
+        int _overrun;
+
+        /* Chunks sent to each client per tick, 1 unless TS_STRATEGY_BURST */
+        int _burst = 1;
 
         std::exponential_distribution<double> _dist_expo;
 
+        /* One tick thread per shard, each one driving its own clients */
+        int _shards = 1;
+        int _running = 0;
+
+        std::vector<TrafficShaperStats> _stats;
+        std::mutex _stats_mtx;
+
         int _state;
         std::mutex _mtx;
         std::condition_variable _cv;
@@ -671,6 +671,16 @@ void *SocksProxyClient::main_thread()
             }
             if (FD_ISSET (fd_bridge, &read_fd_set)) {
                 _controller->handleSocksBridgeDataReady(fdp);
+
+                #if USE_SSL
+                    //one TLS read may buffer several frames, select() only
+                    //reports new data on the socket
+                    for (int i = 1; i < REACTOR_READ_BUDGET &&
+                                    _zombies.find(fdp) == _zombies.end() &&
+                                    fdp->SSL_rx_frame_ready(); i++) {
+                        _controller->handleSocksBridgeDataReady(fdp);
+                    }
+                #endif
             }
         }
 
@@ -823,18 +833,35 @@ int SocksProxyClient::write_msg_client(FdPair *fd_pair, char *buff, int size)
     return write(fd_pair->get_fd0(), buff, size);
 }
 
-int SocksProxyClient::readn_msg_bridge(FdPair *fd_pair, char *buff, int buffsize)
+int SocksProxyClient::readframe_msg_bridge(FdPair *fd_pair, char *buff, int chunk_sz,
+                                           int max_chunks)
 {
-    assert(buff != NULL && buffsize > 0);
+    assert(buff != NULL && chunk_sz > 0 && max_chunks > 0);
 
     if (_fds.find(fd_pair) == _fds.end()) {
         return -1;
     }
 
     #if USE_SSL
-        return fd_pair->SSL_readn(buff, buffsize);
+        return fd_pair->SSL_readframe(buff, chunk_sz, max_chunks);
     #else
-        return readn(fd_pair->get_fd1(), buff, buffsize);
+        int nread = readn(fd_pair->get_fd1(), buff, chunk_sz);
+        if (nread != chunk_sz) {
+            return nread;
+        }
+
+        int num_chunks = (unsigned char) buff[0];
+        if (num_chunks <= 0 || num_chunks > max_chunks) {
+            return -1;
+        }
+        if (num_chunks > 1) {
+            nread = readn(fd_pair->get_fd1(), buff + chunk_sz, (num_chunks - 1) * chunk_sz);
+            if (nread <= 0) {
+                return nread;
+            }
+            nread += chunk_sz;
+        }
+        return nread;
     #endif
 }
 
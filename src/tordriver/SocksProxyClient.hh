@@ -37,7 +37,7 @@ class SocksProxyClient {
 
         int write_msg_client(FdPair *fd_pair, char *buff, int size);
 
-        int readn_msg_bridge(FdPair *fd_pair, char *buff, int buffsize);
+        int readframe_msg_bridge(FdPair *fd_pair, char *buff, int chunk_sz, int max_chunks);
 
         int writen_msg_bridge(FdPair *fd_pair, char *buff, int size);
 
@@ -19,8 +19,14 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <algorithm>
 
 #include "SocksProxyServer.hh"
 #include "../common/Common.hh"
@@ -29,6 +35,15 @@
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 #define ARRAY_INIT    {0}
 
+/* Events of an established connection end */
+#define REACTOR_EVENTS    (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+/* Events of a local end with output parked in its FdPair */
+#define REACTOR_OUT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/* Events of a connection whose handshake may wait for writability */
+#define REACTOR_HS_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
 void SocksProxyServer::log(const char *message, ...)
 {
     char vbuffer[255];
@@ -48,29 +63,60 @@ void SocksProxyServer::log(const char *message, ...)
     fflush(stderr);
 }
 
-int SocksProxyServer::readn_msg_client(FdPair *fd_pair, char *buff, int buffsize)
+int SocksProxyServer::readframe_msg_client(FdPair *fd_pair, char *buff, int chunk_sz,
+                                           int max_chunks)
 {
-    assert(buff != NULL && buffsize > 0);
+    assert(buff != NULL && chunk_sz > 0 && max_chunks > 0);
 
-    if (_fds.find(fd_pair) == _fds.end()) {
+    if (!known(fd_pair)) {
         return -1;
     }
 
+    int nread;
     #if USE_SSL
-        return fd_pair->SSL_readn(buff, buffsize);
+        nread = fd_pair->SSL_readframe(buff, chunk_sz, max_chunks);
+        if (nread <= 0) {
+            fd_pair->setReadable(FDPAIR_END_CLIENT, false);
+        }
     #else
-        return readn(fd_pair->get_fd0(), buff, buffsize);
+        char peek;
+        nread = readn(fd_pair->get_fd0(), buff, chunk_sz);
+        if (nread == chunk_sz) {
+            int num_chunks = (unsigned char) buff[0];
+            if (num_chunks <= 0 || num_chunks > max_chunks) {
+                return -1;
+            }
+            if (num_chunks > 1) {
+                nread = readn(fd_pair->get_fd0(), buff + chunk_sz, (num_chunks - 1) * chunk_sz);
+                if (nread <= 0) {
+                    return nread;
+                }
+                nread += chunk_sz;
+            }
+            if (recv(fd_pair->get_fd0(), &peek, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+                return nread;
+            }
+        }
+        fd_pair->setReadable(FDPAIR_END_CLIENT, false);
     #endif
+
+    return nread;
 }
 
 int SocksProxyServer::writen_msg_client(FdPair *fd_pair, char *buff, int size)
 {
     assert(buff != NULL && size > 0);
 
-    if (_fds.find(fd_pair) == _fds.end()) {
+    if (!known(fd_pair)) {
         return -1;
     }
 
+    #if USE_IO_URING
+        if (fd_pair->getTx()->_enabled) {
+            return uring_write(fd_pair, buff, size);
+        }
+    #endif
+
     #if USE_SSL
         return fd_pair->SSL_writen(buff, size);
     #else
@@ -78,15 +124,230 @@ int SocksProxyServer::writen_msg_client(FdPair *fd_pair, char *buff, int size)
     #endif
 }
 
+/* Hands the output written by the shaper to the io_uring of the shard. The
+sends of all clients are submitted at once by submit_msg_clients(). */
+void SocksProxyServer::queue_msg_client(FdPair *fd_pair)
+{
+    #if USE_IO_URING
+        FdPairTx *tx = fd_pair->getTx();
+        if (!tx->_enabled) {
+            return;
+        }
+
+        Reactor *reactor = _reactors[fd_pair->getShard()];
+        std::unique_lock<std::mutex> uring_lock(reactor->_uring_mtx);
+
+        uring_reap(reactor);
+        if (tx->_inflight || tx->_error) {
+            return;
+        }
+
+        if (tx->_off == tx->_buf.size()) {
+            tx->_buf.clear();
+            tx->_off = 0;
+        }
+
+        #if USE_SSL
+            fd_pair->SSL_drain_wbio(tx->_buf);
+        #else
+            tx->_buf.insert(tx->_buf.end(), tx->_next.begin(), tx->_next.end());
+            tx->_next.clear();
+        #endif
+
+        if (tx->_off == tx->_buf.size()) {
+            return;
+        }
+
+        /* With the submission queue full, submit what it holds to make room.
+        If the kernel takes nothing (completion queue overflow), the output
+        stays in the buffer and is sent on the next tick. */
+        while (reactor->_uring->prepSend(fd_pair->get_fd0(), tx->_buf.data() + tx->_off,
+                                         tx->_buf.size() - tx->_off,
+                                         fd_pair) == IO_URING_ERR_FULL) {
+            int status = reactor->_uring->submit(0);
+            if (status < 0 && status != -EAGAIN && status != -EBUSY) {
+                log("Fatal error: io_uring_enter %d", status);
+                exit(EXIT_FAILURE);
+            }
+            uring_reap(reactor);
+            if (status <= 0) {
+                return;
+            }
+        }
+        tx->_inflight = true;
+    #endif
+}
+
+bool SocksProxyServer::batched_msg_client(FdPair *fd_pair)
+{
+    #if USE_IO_URING
+        return fd_pair->getTx()->_enabled;
+    #else
+        return false;
+    #endif
+}
+
+bool SocksProxyServer::batched_msg_clients(int shard)
+{
+    #if USE_IO_URING
+        return _reactors[shard]->_uring != NULL;
+    #else
+        return false;
+    #endif
+}
+
+void SocksProxyServer::submit_msg_clients(int shard)
+{
+    #if USE_IO_URING
+        Reactor *reactor = _reactors[shard];
+        if (reactor->_uring == NULL) {
+            return;
+        }
+
+        std::unique_lock<std::mutex> uring_lock(reactor->_uring_mtx);
+        int status = reactor->_uring->submit(0);
+        if (status < 0 && status != -EAGAIN && status != -EBUSY) {
+            log("Fatal error: io_uring_enter %d", status);
+            exit(EXIT_FAILURE);
+        }
+        uring_reap(reactor);
+    #endif
+}
+
+#if USE_IO_URING
+void SocksProxyServer::uring_enable(Reactor *reactor, FdPair *fd_pair)
+{
+    if (reactor->_uring == NULL) {
+        return;
+    }
+
+    /* TLS records are written to memory and sent by the shaper in batches */
+    #if USE_SSL
+        BIO *wbio = BIO_new(BIO_s_mem());
+        assert(wbio != NULL);
+        SSL_set0_wbio(fd_pair->getSSL(), wbio);
+    #endif
+
+    fd_pair->getTx()->_enabled = true;
+}
+
+int SocksProxyServer::uring_write(FdPair *fd_pair, char *buff, int size)
+{
+    FdPairTx *tx = fd_pair->getTx();
+    Reactor *reactor = _reactors[fd_pair->getShard()];
+
+    /* Back off as a full socket buffer would. The uring mutex only guards the
+    output handed to the kernel: TLS records are encrypted under the SSL mutex
+    of the connection, so the clients of a shard are written in parallel. */
+    #if USE_SSL
+        int backlog;
+        {
+            std::unique_lock<std::mutex> uring_lock(reactor->_uring_mtx);
+            if (tx->_error) {
+                return -1;
+            }
+            backlog = tx->_buf.size() - tx->_off;
+        }
+
+        if (backlog + fd_pair->SSL_wbio_pending() > IO_URING_MAX_BACKLOG) {
+            return SSL_TRY_LATER;
+        }
+        return fd_pair->SSL_writen(buff, size);
+    #else
+        std::unique_lock<std::mutex> uring_lock(reactor->_uring_mtx);
+        if (tx->_error) {
+            return -1;
+        }
+
+        if (tx->_buf.size() - tx->_off + tx->_next.size() > (size_t) IO_URING_MAX_BACKLOG) {
+            return SSL_TRY_LATER;
+        }
+        tx->_next.insert(tx->_next.end(), buff, buff + size);
+        return size;
+    #endif
+}
+
+/* Called with the uring mutex of the reactor held */
+void SocksProxyServer::uring_reap(Reactor *reactor)
+{
+    void *user_data;
+    int res;
+
+    while (reactor->_uring->reap(user_data, res)) {
+        FdPairTx *tx = ((FdPair *) user_data)->getTx();
+        tx->_inflight = false;
+
+        if (res > 0) {
+            tx->_off += res;
+            if (tx->_off == tx->_buf.size()) {
+                tx->_buf.clear();
+                tx->_off = 0;
+            }
+        } else if (res != -EAGAIN && res != -EINTR) {
+            /* The reactor notices the closed connection on its next read */
+            tx->_error = true;
+            tx->_buf.clear();
+            tx->_off = 0;
+        }
+    }
+}
+
+/* Waits for the send in flight of a connection about to be freed, whose
+buffer and FdPair the kernel still references */
+void SocksProxyServer::uring_forget(Reactor *reactor, FdPair *fd_pair)
+{
+    FdPairTx *tx = fd_pair->getTx();
+    if (!tx->_enabled) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> uring_lock(reactor->_uring_mtx);
+    uring_reap(reactor);
+    while (tx->_inflight) {
+        int status = reactor->_uring->submit(1);
+        if (status < 0 && status != -EAGAIN && status != -EBUSY) {
+            log("Fatal error: io_uring_enter %d", status);
+            exit(EXIT_FAILURE);
+        }
+        uring_reap(reactor);
+    }
+}
+#endif
+
 int SocksProxyServer::read_msg_local(FdPair *fd_pair, char *buff, int buffsize)
 {
     assert(buff != NULL && buffsize > 0);
 
-    if (_fds.find(fd_pair) == _fds.end()) {
+    if (!known(fd_pair)) {
         return -1;
     }
 
-    return read(fd_pair->get_fd1(), buff, buffsize);
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
+    if (fd_pair->get_fd1() == INV_FD) {
+        fd_pair->setReadable(FDPAIR_END_LOCAL, false);
+        return -1;
+    }
+
+    /* Tor is not consuming what it is sent, stop producing more for it until
+    flush_local() drains the output below the low-water mark */
+    FdPairLocalOut *out = fd_pair->getLocalOut();
+    if (out->pending() > LOCAL_OUT_HIGH_WATER) {
+        out->_paused = true;
+        fd_pair->setReadable(FDPAIR_END_LOCAL, false);
+        return SSL_TRY_LATER;
+    }
+
+    int nread = read(fd_pair->get_fd1(), buff, buffsize);
+
+    /* A short read means the socket buffer was drained */
+    if (nread < buffsize) {
+        fd_pair->setReadable(FDPAIR_END_LOCAL, false);
+    }
+
+    if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return SSL_TRY_LATER;
+    }
+    return nread;
 }
 
 
@@ -94,47 +355,220 @@ int SocksProxyServer::write_msg_local(FdPair *fd_pair, char *buff, int size)
 {
     assert(buff != NULL && size > 0);
 
-    if (_fds.find(fd_pair) == _fds.end()) {
+    if (!known(fd_pair)) {
         return -1;
     }
 
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
     return write(fd_pair->get_fd1(), buff, size);
 }
 
 
 int SocksProxyServer::writen_msg_local(FdPair *fd_pair, char *buff, int size)
 {
+    int nwrite = 0;
     assert(buff != NULL && size > 0);
-    int status;
 
-    if (_fds.find(fd_pair) == _fds.end()) {
+    if (!known(fd_pair)) {
         return -1;
     }
 
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
     int fd = fd_pair->get_fd1();
     if (fd == INV_FD) { //No Tor connection currently established
-        fd = restore_local_connection(fd_pair);
+        fd = connect_local(fd_pair);
+    }
+
+    /* Write what the socket takes now and park the rest, keeping the order
+    behind output that is already waiting */
+    FdPairLocalOut *out = fd_pair->getLocalOut();
+    if (out->pending() == 0) {
+        while (nwrite < size) {
+            int status = write(fd, buff + nwrite, size - nwrite);
+            if (status == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return -1;
+            }
+            nwrite += status;
+        }
+
+        if (nwrite == size) {
+            return size;
+        }
+
+        int status = reactor_mod(fd, fd_pair->getEnd(FDPAIR_END_LOCAL),
+                                 REACTOR_OUT_EVENTS);
+        assert(status == 0);
     }
 
-    return writen(fd, buff, size);
+    out->_buf.insert(out->_buf.end(), buff + nwrite, buff + size);
+    return size;
+}
+
+/* Same as writen_msg_local for several buffers, written with one writev() while
+nothing is parked. iov is consumed. */
+int SocksProxyServer::writevn_msg_local(FdPair *fd_pair, struct iovec *iov,
+                                        int iovcnt)
+{
+    int size = 0;
+    assert(iov != NULL && iovcnt > 0);
+
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+
+    if (!known(fd_pair)) {
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
+    int fd = fd_pair->get_fd1();
+    if (fd == INV_FD) { //No Tor connection currently established
+        fd = connect_local(fd_pair);
+    }
+
+    FdPairLocalOut *out = fd_pair->getLocalOut();
+    if (out->pending() == 0) {
+        while (iovcnt > 0) {
+            ssize_t status = writev(fd, iov, std::min(iovcnt, IOV_MAX));
+            if (status == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return -1;
+            }
+
+            //skip what was written, the first buffer left may be partial
+            while (iovcnt > 0 && status >= (ssize_t) iov->iov_len) {
+                status -= iov->iov_len;
+                iov++; iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = (char*) iov->iov_base + status;
+                iov->iov_len -= status;
+            }
+        }
+
+        if (iovcnt == 0) {
+            return size;
+        }
+
+        int status = reactor_mod(fd, fd_pair->getEnd(FDPAIR_END_LOCAL),
+                                 REACTOR_OUT_EVENTS);
+        assert(status == 0);
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        char *buff = (char*) iov[i].iov_base;
+        out->_buf.insert(out->_buf.end(), buff, buff + iov[i].iov_len);
+    }
+    return size;
+}
+
+/* Reads again from a local end the controller stopped reading. May be called
+from any thread, the owner reactor schedules the connection. */
+void SocksProxyServer::resume_local(FdPair *fd_pair)
+{
+    resume(fd_pair, FDPAIR_END_LOCAL);
+}
+
+/* Same as resume_local for the client end */
+void SocksProxyServer::resume_client(FdPair *fd_pair)
+{
+    resume(fd_pair, FDPAIR_END_CLIENT);
+}
+
+void SocksProxyServer::resume(FdPair *fd_pair, int end)
+{
+    Reactor *reactor = _reactors[fd_pair->getShard()];
+    {
+        std::unique_lock<std::mutex> resumed_lock(reactor->_resumed_mtx);
+        reactor->_resumed.push_back(fd_pair->getEnd(end));
+    }
+    wake(reactor);
+}
+
+/* Sends the output parked for the local end once it is writable again. Runs
+on the owner reactor. */
+void SocksProxyServer::flush_local(Reactor *reactor, FdPair *fd_pair)
+{
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
+    FdPairLocalOut *out = fd_pair->getLocalOut();
+    int fd = fd_pair->get_fd1();
+
+    if (fd == INV_FD || out->pending() == 0) {
+        return;
+    }
+
+    while (out->pending() > 0) {
+        int nwrite = write(fd, out->_buf.data() + out->_off, out->pending());
+        if (nwrite == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            /* Broken connection, the read handler reports it */
+            out->clear();
+            out->_paused = false;
+            fd_pair->setReadable(FDPAIR_END_LOCAL, true);
+            schedule(reactor, fd_pair);
+            return;
+        }
+        out->_off += nwrite;
+    }
+
+    if (out->pending() == 0) {
+        out->clear();
+        int status = reactor_mod(fd, fd_pair->getEnd(FDPAIR_END_LOCAL),
+                                 REACTOR_EVENTS);
+        assert(status == 0);
+    } else if (out->_off > out->_buf.size() / 2) {
+        out->_buf.erase(out->_buf.begin(), out->_buf.begin() + out->_off);
+        out->_off = 0;
+    }
+
+    /* Readiness was consumed while paused, read again */
+    if (out->_paused && out->pending() < LOCAL_OUT_LOW_WATER) {
+        out->_paused = false;
+        fd_pair->setReadable(FDPAIR_END_LOCAL, true);
+        schedule(reactor, fd_pair);
+    }
 }
 
 int SocksProxyServer::shutdown_connection(FdPair *fd_pair)
 {
-    assert(_fds.find(fd_pair) != _fds.end());
+    assert(known(fd_pair));
+
+    /* May be called from any shard, the owner reactor frees the connection */
+    Reactor *reactor = _reactors[fd_pair->getShard()];
+    std::unique_lock<std::mutex> zombies_lock(reactor->_zombies_mtx);
 
-    if (_zombies.find(fd_pair) == _zombies.end()) {
+    if (reactor->_zombies.find(fd_pair) == reactor->_zombies.end()) {
         if (fd_pair->get_fd0() != INV_FD) {
             shutdown(fd_pair->get_fd0(), SHUT_RDWR);
-            FD_CLR (fd_pair->get_fd0(), &_active_fd_set);
+            reactor_del(fd_pair, fd_pair->get_fd0());
         }
 
-        if (fd_pair->get_fd1() != INV_FD) {
-            shutdown(fd_pair->get_fd1(), SHUT_RDWR);
-            FD_CLR (fd_pair->get_fd1(), &_active_fd_set);
+        {
+            std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
+            if (fd_pair->get_fd1() != INV_FD) {
+                shutdown(fd_pair->get_fd1(), SHUT_RDWR);
+                reactor_del(fd_pair, fd_pair->get_fd1());
+            }
         }
 
-        _zombies.insert(fd_pair);
+        reactor->_zombies.insert(fd_pair);
+        wake(reactor);
     }
     return 0;
 }
@@ -142,18 +576,25 @@ int SocksProxyServer::shutdown_connection(FdPair *fd_pair)
 int SocksProxyServer::shutdown_local_connection(FdPair *fd_pair) {
     int status;
 
-    assert(_fds.find(fd_pair) != _fds.end());
+    assert(known(fd_pair));
 
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
     if (fd_pair->get_fd1() != INV_FD) {
+        /* The local end may already have been reset by Tor */
         status = shutdown(fd_pair->get_fd1(), SHUT_RDWR);
-        assert(status == 0);
+        assert(status == 0 || errno == ENOTCONN);
 
-        FD_CLR (fd_pair->get_fd1(), &_active_fd_set);
+        reactor_del(fd_pair, fd_pair->get_fd1());
 
         status = close(fd_pair->get_fd1());
         assert(status == 0);
 
         fd_pair->set_fd1(INV_FD);
+        fd_pair->setReadable(FDPAIR_END_LOCAL, false);
+
+        /* Output for the closed connection is not sent to the next one */
+        fd_pair->getLocalOut()->clear();
+        fd_pair->getLocalOut()->_paused = false;
     }
 
     #if (LOG_VERBOSE & LOG_BIT_CTRL_LOCK)
@@ -165,12 +606,19 @@ int SocksProxyServer::shutdown_local_connection(FdPair *fd_pair) {
 
 int SocksProxyServer::restore_local_connection(FdPair *fd_pair) {
 
-    assert(_fds.find(fd_pair) != _fds.end());
+    assert(known(fd_pair));
 
+    std::unique_lock<std::mutex> local_lock(fd_pair->getLocalMutex());
     if (fd_pair->get_fd1() != INV_FD) {
         return -1;
     }
 
+    return connect_local(fd_pair);
+}
+
+int SocksProxyServer::connect_local(FdPair *fd_pair) {
+
+    /* The caller holds the local mutex of fd_pair */
     struct addrinfo hints, *res;
     int fd_local;
 
@@ -198,10 +646,15 @@ int SocksProxyServer::restore_local_connection(FdPair *fd_pair) {
     }
     freeaddrinfo(res);
 
+    int status = fcntl(fd_local, F_SETFL, fcntl(fd_local, F_GETFL, 0) | O_NONBLOCK);
+    assert(status == 0);
+
     assert(fd_pair != nullptr && fd_pair->get_fd1() == INV_FD);
     fd_pair->set_fd1(fd_local);
 
-    FD_SET(fd_local, &_active_fd_set);
+    status = reactor_add(fd_local, fd_pair->getEnd(FDPAIR_END_LOCAL),
+                         REACTOR_EVENTS);
+    assert(status == 0);
 
     #if (LOG_VERBOSE & LOG_BIT_CTRL_LOCK)
         log("Restored local connection: client %d, local %d", fd_pair->get_fd0(),
@@ -211,14 +664,251 @@ int SocksProxyServer::restore_local_connection(FdPair *fd_pair) {
     return fd_local;
 }
 
-void *SocksProxyServer::main_thread()
+/* Connections are registered in the epoll instance of the reactor that owns
+them, whichever shard thread makes the call */
+int SocksProxyServer::reactor_add(int fd, FdPairEnd *end, unsigned int events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = end;
+    return epoll_ctl(_reactors[end->_fdp->getShard()]->_epoll_fd,
+                     EPOLL_CTL_ADD, fd, &ev);
+}
+
+int SocksProxyServer::reactor_mod(int fd, FdPairEnd *end, unsigned int events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = end;
+    return epoll_ctl(_reactors[end->_fdp->getShard()]->_epoll_fd,
+                     EPOLL_CTL_MOD, fd, &ev);
+}
+
+int SocksProxyServer::reactor_del(FdPair *fd_pair, int fd)
+{
+    return epoll_ctl(_reactors[fd_pair->getShard()]->_epoll_fd,
+                     EPOLL_CTL_DEL, fd, NULL);
+}
+
+void SocksProxyServer::schedule(Reactor *reactor, FdPair *fd_pair)
+{
+    if (!fd_pair->isScheduled()) {
+        fd_pair->setScheduled(true);
+        reactor->_ready.push_back(fd_pair);
+    }
+}
+
+void SocksProxyServer::wake(Reactor *reactor)
+{
+    uint64_t one = 1;
+    if (write(reactor->_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        assert(errno == EAGAIN);
+    }
+}
+
+bool SocksProxyServer::known(FdPair *fd_pair)
+{
+    //the pair may already be freed, so its shard cannot be read: look it up
+    //in the connections of every shard
+    for (Reactor *reactor : _reactors) {
+        std::shared_lock<std::shared_mutex> fds_lock(reactor->_fds_mtx);
+        if (reactor->_fds.find(fd_pair) != reactor->_fds.end()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SocksProxyServer::is_zombie(Reactor *reactor, FdPair *fd_pair)
+{
+    std::unique_lock<std::mutex> zombies_lock(reactor->_zombies_mtx);
+    return reactor->_zombies.find(fd_pair) != reactor->_zombies.end();
+}
+
+void SocksProxyServer::dispatch(Reactor *reactor, FdPair *fd_pair)
+{
+    /* Edge-triggered: keep calling the handlers until the read helpers
+    report the end as drained, bounded by the budget for fairness */
+    for (int i = 0; i < REACTOR_READ_BUDGET &&
+                    fd_pair->isReadable(FDPAIR_END_CLIENT); i++) {
+        _controller->handleSocksClientDataReady(fd_pair);
+        if (is_zombie(reactor, fd_pair)) {
+            return;
+        }
+    }
+
+    for (int i = 0; i < REACTOR_READ_BUDGET &&
+                    fd_pair->isReadable(FDPAIR_END_LOCAL); i++) {
+        if (fd_pair->get_fd1() == INV_FD) {
+            fd_pair->setReadable(FDPAIR_END_LOCAL, false);
+            break;
+        }
+        _controller->handleSocksBridgeDataReady(fd_pair);
+        if (is_zombie(reactor, fd_pair)) {
+            return;
+        }
+    }
+}
+
+#if USE_SSL
+void SocksProxyServer::continue_handshake(Reactor *reactor, FdPair *fd_pair)
+{
+    int status, error;
+
+    status = SSL_accept(fd_pair->getSSL());
+    if (status <= 0) {
+        error = SSL_get_error(fd_pair->getSSL(), status);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            return;
+        }
+
+        ERR_print_errors_fp(stderr);
+        #if (LOG_VERBOSE & LOG_BIT_SSL)
+            log("SSL_accept error: %d", error);
+        #endif
+        _hs_failed++;
+        drop_handshake(reactor, fd_pair);
+        return;
+    }
+
+    #if (LOG_VERBOSE & LOG_BIT_SSL)
+        log("SSL_accept success");
+    #endif
+
+    reactor->_handshakes.erase(fd_pair);
+    _hs_pending--;
+    _hs_completed++;
+    fd_pair->setHandshaking(false);
+
+    status = reactor_mod(fd_pair->get_fd0(), fd_pair->getEnd(FDPAIR_END_CLIENT),
+                         REACTOR_EVENTS);
+    assert(status == 0);
+
+    #if USE_IO_URING
+        uring_enable(reactor, fd_pair);
+    #endif
+
+    {
+        std::unique_lock<std::shared_mutex> fds_lock(reactor->_fds_mtx);
+        reactor->_fds.insert(fd_pair);
+    }
+    _controller->handleSocksNewConnection(fd_pair);
+
+    /* The first frames may have arrived along with the handshake */
+    fd_pair->setReadable(FDPAIR_END_CLIENT, true);
+    schedule(reactor, fd_pair);
+}
+
+void SocksProxyServer::drop_handshake(Reactor *reactor, FdPair *fd_pair)
+{
+    assert(fd_pair->isHandshaking());
+
+    reactor->_handshakes.erase(fd_pair);
+    _hs_pending--;
+
+    reactor_del(fd_pair, fd_pair->get_fd0());
+    SSL_free(fd_pair->getSSL());
+    close(fd_pair->get_fd0());
+    delete fd_pair;
+}
+
+void SocksProxyServer::expire_handshakes(Reactor *reactor)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now < reactor->_next_hs_check) {
+        return;
+    }
+    reactor->_next_hs_check = now + std::chrono::milliseconds(HANDSHAKE_CHECK_MS);
+
+    std::vector<FdPair*> expired;
+    for (std::pair<FdPair*, std::chrono::steady_clock::time_point> hs :
+         reactor->_handshakes) {
+        if (hs.second <= now) {
+            expired.push_back(hs.first);
+        }
+    }
+
+    for (FdPair *fd_pair : expired) {
+        #if (LOG_VERBOSE & LOG_BIT_SSL)
+            log("SSL_accept timeout: client %d", fd_pair->get_fd0());
+        #endif
+        _hs_expired++;
+        drop_handshake(reactor, fd_pair);
+    }
+}
+#endif
+
+void SocksProxyServer::accept_connections(Reactor *reactor, int sock_fd)
 {
-    int sock_fd, fd_client, fd_local;
+    int fd_client, status;
+
+    while (true) {
+        struct sockaddr_in remote;
+        socklen_t remotelen = sizeof(remote);
+        fd_client = accept(sock_fd, (struct sockaddr *)&remote, &remotelen);
+        if (fd_client < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED) {
+                return;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                log("accept(): out of file descriptors");
+                return;
+            }
+            log("Fatal error: accept()");
+            exit(EXIT_FAILURE);
+        }
+
+        #if USE_SSL
+            status = fcntl(fd_client, F_SETFL, fcntl(fd_client, F_GETFL, 0) | O_NONBLOCK);
+            assert(status == 0);
+
+            SSL *ssl = SSL_new(_ssl_ctx);
+            status = SSL_set_fd(ssl, fd_client);
+            assert(status == 1);
+            SSL_set_accept_state(ssl);
+
+            /* The connection is only handed to the controller once the
+            handshake completes in continue_handshake() */
+            FdPair *fd_pair = new FdPair(fd_client, INV_FD, ssl);
+            fd_pair->setShard(reactor->_shard);
+            fd_pair->setHandshaking(true);
+            reactor->_handshakes[fd_pair] = std::chrono::steady_clock::now() +
+                                   std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+            _hs_pending++;
+
+            status = reactor_add(fd_client, fd_pair->getEnd(FDPAIR_END_CLIENT),
+                                 REACTOR_HS_EVENTS);
+            assert(status == 0);
+
+            continue_handshake(reactor, fd_pair);
+
+        #else
+            FdPair *fd_pair = new FdPair(fd_client, INV_FD);
+            fd_pair->setShard(reactor->_shard);
+            #if USE_IO_URING
+                uring_enable(reactor, fd_pair);
+            #endif
+            {
+                std::unique_lock<std::shared_mutex> fds_lock(reactor->_fds_mtx);
+                reactor->_fds.insert(fd_pair);
+            }
+            status = reactor_add(fd_client, fd_pair->getEnd(FDPAIR_END_CLIENT),
+                                 REACTOR_EVENTS);
+            assert(status == 0);
+            _hs_completed++;
+            _controller->handleSocksNewConnection(fd_pair);
+        #endif
+    }
+}
+
+int SocksProxyServer::open_listen_socket()
+{
+    int sock_fd, status;
     struct addrinfo hints, *res;
     int reuseaddr = 1; /* True */
-    fd_set read_fd_set;
-
-    signal(SIGPIPE, SIG_IGN);
 
     /* Get the address info */
     memset(&hints, 0, sizeof hints);
@@ -247,6 +937,16 @@ void *SocksProxyServer::main_thread()
         exit(EXIT_FAILURE);
     }
 
+    /* Every reactor listens on the same port, the kernel spreads the
+    incoming connections between them */
+    if (_reactors.size() > 1 && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+                                           &reuseaddr, sizeof(int)) == -1)
+    {
+        log("Fatal error: setsockopt SO_REUSEPORT");
+        freeaddrinfo(res);
+        exit(EXIT_FAILURE);
+    }
+
     /* Bind to the address */
     struct sockaddr_in local;
     memset(&local, 0, sizeof(local));
@@ -266,72 +966,140 @@ void *SocksProxyServer::main_thread()
     }
     freeaddrinfo(res);
 
+    status = fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL, 0) | O_NONBLOCK);
+    assert(status == 0);
 
-    FD_ZERO (&_active_fd_set);
-    FD_SET (sock_fd, &_active_fd_set);
+    return sock_fd;
+}
+
+void *SocksProxyServer::main_thread(int shard)
+{
+    int sock_fd, nevents, timeout;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    Reactor *reactor = _reactors[shard];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sock_fd = open_listen_socket();
+
+    /* The listen socket is the only entry with a NULL data pointer */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(reactor->_epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+        log("Fatal error: epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
     while (true) {
 
-        read_fd_set = _active_fd_set;
-        if (select (FD_SETSIZE, &read_fd_set, NULL, NULL, NULL) < 0) {
-            log ("Fatal error: select()");
+        /* Do not block while connections still have pending input, and wake
+        up periodically to expire stalled handshakes */
+        timeout = -1;
+        #if USE_SSL
+            if (!reactor->_handshakes.empty()) {
+                timeout = HANDSHAKE_CHECK_MS;
+            }
+        #endif
+        if (!reactor->_ready.empty()) {
+            timeout = 0;
+        }
+
+        nevents = epoll_wait(reactor->_epoll_fd, events, REACTOR_MAX_EVENTS,
+                             timeout);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log ("Fatal error: epoll_wait()");
             exit(EXIT_FAILURE);
         }
 
-        if (FD_ISSET (sock_fd, &read_fd_set)) {
+        for (int i = 0; i < nevents; i++) {
+            FdPairEnd *end = (FdPairEnd*) events[i].data.ptr;
 
-            struct sockaddr_in remote;
-            socklen_t remotelen = sizeof(remote);
-            fd_client = accept(sock_fd, (struct sockaddr *)&remote, &remotelen);
-            if (fd_client < 0) {
-                log("Fatal error: accept()");
-                exit(EXIT_FAILURE);
+            if (end == NULL) {
+                accept_connections(reactor, sock_fd);
+                continue;
+            }
+
+            /* Another thread queued a zombie or a resumed connection, both
+            are handled below */
+            if (end == &reactor->_wake_end) {
+                uint64_t count;
+                while (read(reactor->_wake_fd, &count, sizeof(count)) > 0);
+                continue;
             }
 
             #if USE_SSL
-                SSL *ssl = SSL_new(_ssl_ctx);
-                int status = SSL_set_fd(ssl, fd_client);
-                assert(status == 1);
-
-                if ((status = SSL_accept(ssl)) <= 0) {
-                    ERR_print_errors_fp(stderr);
-                    #if (LOG_VERBOSE & LOG_BIT_SSL)
-                        log("SSL_accept error: %d", status);
-                    #endif
+                if (end->_fdp->isHandshaking()) {
+                    continue_handshake(reactor, end->_fdp);
                     continue;
                 }
+            #endif
 
-                status = fcntl(fd_client, F_SETFL, fcntl(fd_client, F_GETFL, 0) | O_NONBLOCK);
-                assert(status == 0);
+            if (events[i].events & EPOLLOUT) {
+                flush_local(reactor, end->_fdp);
+            }
 
-                #if (LOG_VERBOSE & LOG_BIT_SSL)
-                    log("SSL_accept success");
-                #endif
+            /* Hangups and errors are reported by the handlers on read */
+            if (events[i].events & ~EPOLLOUT) {
+                end->_fdp->setReadable(end->_end, true);
+                schedule(reactor, end->_fdp);
+            }
+        }
 
-                FdPair *fd_pair = new FdPair(fd_client, INV_FD, ssl);
+        #if USE_SSL
+            if (!reactor->_handshakes.empty()) {
+                expire_handshakes(reactor);
+            }
+        #endif
 
-            #else
-                FdPair *fd_pair = new FdPair(fd_client, INV_FD);
-            #endif
-            _fds.insert(fd_pair);
-            FD_SET (fd_client, &_active_fd_set);
-            _controller->handleSocksNewConnection(fd_pair);
+        std::vector<FdPairEnd*> resumed;
+        {
+            std::unique_lock<std::mutex> resumed_lock(reactor->_resumed_mtx);
+            resumed.swap(reactor->_resumed);
+        }
+        for (FdPairEnd *end : resumed) {
+            if (!is_zombie(reactor, end->_fdp)) {
+                end->_fdp->setReadable(end->_end, true);
+                schedule(reactor, end->_fdp);
+            }
         }
 
-        for (FdPair *fdp : _fds) {
-            fd_client = fdp->get_fd0();
-            fd_local = fdp->get_fd1();
-            if (FD_ISSET (fd_client, &read_fd_set)) {
-                _controller->handleSocksClientDataReady(fdp);
+        std::vector<FdPair*> ready;
+        ready.swap(reactor->_ready);
+        for (FdPair *fdp : ready) {
+            fdp->setScheduled(false);
+            if (is_zombie(reactor, fdp)) {
+                continue;
             }
-            if (fd_local != INV_FD && FD_ISSET (fd_local, &read_fd_set)) {
-                _controller->handleSocksBridgeDataReady(fdp);
+
+            dispatch(reactor, fdp);
+
+            if (!is_zombie(reactor, fdp) &&
+                (fdp->isReadable(FDPAIR_END_CLIENT) ||
+                 fdp->isReadable(FDPAIR_END_LOCAL))) {
+                schedule(reactor, fdp);
             }
         }
 
-        for (FdPair* fd_zombie : _zombies) {
+        /* Zombies stay in the set until freed so that a concurrent
+        shutdown_connection() from another shard does not queue them twice */
+        std::set<FdPair*> zombies;
+        {
+            std::unique_lock<std::mutex> zombies_lock(reactor->_zombies_mtx);
+            zombies = reactor->_zombies;
+        }
+
+        for (FdPair* fd_zombie : zombies) {
             _controller->handleSocksConnectionTerminated(fd_zombie);
 
+            #if USE_IO_URING
+                uring_forget(reactor, fd_zombie);
+            #endif
+
             #if USE_SSL
                 SSL* ssl = fd_zombie->getSSL();
                 assert(ssl != NULL);
@@ -342,25 +1110,69 @@ void *SocksProxyServer::main_thread()
                 #endif
             #endif
 
-            _fds.erase(fd_zombie);
+            if (fd_zombie->isScheduled()) {
+                reactor->_ready.erase(std::remove(reactor->_ready.begin(),
+                                                  reactor->_ready.end(),
+                                                  fd_zombie),
+                                      reactor->_ready.end());
+            }
+
+            {
+                std::unique_lock<std::mutex> resumed_lock(reactor->_resumed_mtx);
+                reactor->_resumed.erase(std::remove_if(reactor->_resumed.begin(),
+                                                       reactor->_resumed.end(),
+                    [fd_zombie](FdPairEnd *end) { return end->_fdp == fd_zombie; }),
+                                        reactor->_resumed.end());
+            }
+
+            {
+                std::unique_lock<std::shared_mutex> fds_lock(reactor->_fds_mtx);
+                reactor->_fds.erase(fd_zombie);
+            }
+            {
+                std::unique_lock<std::mutex> zombies_lock(reactor->_zombies_mtx);
+                reactor->_zombies.erase(fd_zombie);
+            }
             close(fd_zombie->get_fd0());
             close(fd_zombie->get_fd1());
             delete fd_zombie;
         }
-        _zombies.clear();
     }
 
     return NULL;
 }
 
+int SocksProxyServer::getPendingHandshakes()
+{
+    return _hs_pending;
+}
+
+unsigned int SocksProxyServer::getCompletedHandshakes()
+{
+    return _hs_completed;
+}
+
+unsigned int SocksProxyServer::getFailedHandshakes()
+{
+    return _hs_failed;
+}
+
+unsigned int SocksProxyServer::getExpiredHandshakes()
+{
+    return _hs_expired;
+}
+
 #if USE_SSL
 int SocksProxyServer::initialize(ControllerServer *controller, SSL_CTX *ssl_ctx,
-    int port_cli, int port_local, int run_mode)
+    int port_cli, int port_local, int run_mode, int reactors, bool io_uring)
 #else
 int SocksProxyServer::initialize(ControllerServer *controller, int port_cli,
-    int port_local, int run_mode)
+    int port_local, int run_mode, int reactors, bool io_uring)
 #endif
 {
+    struct rlimit nofile;
+    int status;
+
     #if USE_SSL
         assert(controller != NULL && ssl_ctx != NULL);
         _ssl_ctx = ssl_ctx;
@@ -372,15 +1184,78 @@ int SocksProxyServer::initialize(ControllerServer *controller, int port_cli,
     _port_cli = port_cli;
     _port_local = port_local;
 
+    /* Each client holds two descriptors, use as many as we are allowed to */
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &nofile) != 0) {
+            log("Could not raise RLIMIT_NOFILE");
+        }
+    }
+
+    assert(reactors > 0);
+    for (int shard = 0; shard < reactors; shard++) {
+        Reactor *reactor = new Reactor();
+        reactor->_shard = shard;
+
+        reactor->_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactor->_epoll_fd == -1) {
+            log("Fatal error: epoll_create1");
+            exit(EXIT_FAILURE);
+        }
+
+        reactor->_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->_wake_fd == -1) {
+            log("Fatal error: eventfd");
+            exit(EXIT_FAILURE);
+        }
+
+        reactor->_wake_end._fdp = NULL;
+        reactor->_wake_end._end = FDPAIR_END_CLIENT;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &reactor->_wake_end;
+        if (epoll_ctl(reactor->_epoll_fd, EPOLL_CTL_ADD, reactor->_wake_fd, &ev) == -1) {
+            log("Fatal error: epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+
+        #if USE_IO_URING
+            reactor->_uring = NULL;
+            if (io_uring) {
+                reactor->_uring = new IoUring();
+                status = reactor->_uring->initialize(IO_URING_ENTRIES);
+                if (status != 0) {
+                    log("io_uring not available (%s), using direct writes",
+                        strerror(-status));
+                    delete reactor->_uring;
+                    reactor->_uring = NULL;
+                }
+            }
+        #else
+            if (io_uring) {
+                log("Built without io_uring support, using direct writes");
+            }
+        #endif
+
+        _reactors.push_back(reactor);
+    }
 
     if (run_mode == RUN_BACKGROUND) {
-        std::thread th(&SocksProxyServer::main_thread, this);
-        th.detach();
+        for (int shard = 0; shard < reactors; shard++) {
+            std::thread th(&SocksProxyServer::main_thread, this, shard);
+            th.detach();
+        }
         return 0;
     }
 
     if (run_mode == RUN_FOREGROUND) {
-        main_thread();
+        for (int shard = 1; shard < reactors; shard++) {
+            std::thread th(&SocksProxyServer::main_thread, this, shard);
+            th.detach();
+        }
+        main_thread(0);
         return 0;
     }
 
@@ -2,11 +2,60 @@
 #define SOCKSPROXYSERVER_H
 
 #include <set>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/uio.h>
 #include "../common/Common.hh"
+#include "../common/IoUring.hh"
 
 #include "../controller/ControllerServer.hh"
 
 
+/* State owned by one reactor thread: its epoll instance and the connections
+accepted on its listen socket */
+struct Reactor {
+    int _shard;
+
+    int _epoll_fd;
+
+    /* eventfd used by other shards to wake the reactor up */
+    int _wake_fd;
+    FdPairEnd _wake_end;
+
+    /* Connections with pending input left after their read budget */
+    std::vector<FdPair*> _ready;
+
+    /* Live connections of the shard, checked by every thread that reads or
+    writes one of them */
+    std::set<FdPair*> _fds;
+    std::shared_mutex _fds_mtx;
+
+    std::set<FdPair*> _zombies;
+    std::mutex _zombies_mtx;
+
+    /* Connection ends other threads asked to read again */
+    std::vector<FdPairEnd*> _resumed;
+    std::mutex _resumed_mtx;
+
+    #if USE_IO_URING
+        /* Batched client sends, NULL when the backend is disabled or the
+        kernel lacks io_uring. Shared by the reactor and the shaper tick. */
+        IoUring *_uring;
+        std::mutex _uring_mtx;
+    #endif
+
+    #if USE_SSL
+        /* Accepted connections whose TLS handshake is in progress */
+        std::map<FdPair*, std::chrono::steady_clock::time_point> _handshakes;
+
+        std::chrono::steady_clock::time_point _next_hs_check;
+    #endif
+};
+
 class SocksProxyServer {
 
     public:
@@ -17,22 +66,41 @@ class SocksProxyServer {
 
         #if USE_SSL
             int initialize(ControllerServer *controller, SSL_CTX *ssl_ctx,
-                           int port_cli, int port_local, int run_mode);
+                           int port_cli, int port_local, int run_mode,
+                           int reactors = 1, bool io_uring = false);
         #else
             int initialize(ControllerServer *controller, int port_cli,
-                           int port_local, int run_mode);
+                           int port_local, int run_mode, int reactors = 1,
+                           bool io_uring = false);
         #endif
 
-        int readn_msg_client(FdPair *fd_pair, char *buff, int buffsize);
+        int readframe_msg_client(FdPair *fd_pair, char *buff, int chunk_sz, int max_chunks);
 
         int writen_msg_client(FdPair *fd_pair, char *buff, int size);
 
+        void queue_msg_client(FdPair *fd_pair);
+
+        /* True when writes to a client only fill its output buffer, which
+        queue_msg_client() later hands to the kernel */
+        bool batched_msg_client(FdPair *fd_pair);
+
+        /* True when the clients of a shard are written in batches */
+        bool batched_msg_clients(int shard);
+
+        void submit_msg_clients(int shard);
+
         int read_msg_local(FdPair *fd_pair, char *buff, int buffsize);
 
         int write_msg_local(FdPair *fd_pair, char *buff, int size);
 
         int writen_msg_local(FdPair *fd_pair, char *buff, int size);
 
+        int writevn_msg_local(FdPair *fd_pair, struct iovec *iov, int iovcnt);
+
+        void resume_local(FdPair *fd_pair);
+
+        void resume_client(FdPair *fd_pair);
+
         int shutdown_connection(FdPair *fd_pair);
 
         int shutdown_local_connection(FdPair *fd_pair);
@@ -41,9 +109,61 @@ class SocksProxyServer {
 
         void log(const char *message, ...);
 
+        int getPendingHandshakes();
+
+        unsigned int getCompletedHandshakes();
+
+        unsigned int getFailedHandshakes();
+
+        unsigned int getExpiredHandshakes();
+
     private:
 
-        void *main_thread();
+        void *main_thread(int shard);
+
+        int open_listen_socket();
+
+        #if USE_SSL
+            void continue_handshake(Reactor *reactor, FdPair *fd_pair);
+
+            void drop_handshake(Reactor *reactor, FdPair *fd_pair);
+
+            void expire_handshakes(Reactor *reactor);
+        #endif
+
+        void accept_connections(Reactor *reactor, int sock_fd);
+
+        void dispatch(Reactor *reactor, FdPair *fd_pair);
+
+        void schedule(Reactor *reactor, FdPair *fd_pair);
+
+        void wake(Reactor *reactor);
+
+        void resume(FdPair *fd_pair, int end);
+
+        bool known(FdPair *fd_pair);
+
+        bool is_zombie(Reactor *reactor, FdPair *fd_pair);
+
+        int connect_local(FdPair *fd_pair);
+
+        void flush_local(Reactor *reactor, FdPair *fd_pair);
+
+        #if USE_IO_URING
+            void uring_enable(Reactor *reactor, FdPair *fd_pair);
+
+            int uring_write(FdPair *fd_pair, char *buff, int size);
+
+            void uring_reap(Reactor *reactor);
+
+            void uring_forget(Reactor *reactor, FdPair *fd_pair);
+        #endif
+
+        int reactor_add(int fd, FdPairEnd *end, unsigned int events);
+
+        int reactor_mod(int fd, FdPairEnd *end, unsigned int events);
+
+        int reactor_del(FdPair *fd_pair, int fd);
 
     private:
 
@@ -53,16 +173,17 @@ class SocksProxyServer {
 
         ControllerServer *_controller;
 
-        std::set<FdPair*> _fds;
-
-        fd_set _active_fd_set;
-
-        std::set<FdPair*> _zombies;
+        std::vector<Reactor*> _reactors;
 
         #if USE_SSL
             SSL_CTX *_ssl_ctx;
         #endif
 
+        std::atomic<int> _hs_pending{0};
+        std::atomic<unsigned int> _hs_completed{0};
+        std::atomic<unsigned int> _hs_failed{0};
+        std::atomic<unsigned int> _hs_expired{0};
+
 };
 
 #endif //SOCKSPROXYSERVER_H
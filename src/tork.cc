@@ -27,12 +27,22 @@ struct params
     std::string bridge_ssl_key;
     unsigned int chunk_size;
     unsigned int max_chunks;
+    std::string frame_sizing;
     unsigned int ts_min;
     unsigned int ts_max;
+    std::string ts_overrun;
+    unsigned int ts_burst;
+    std::string ts_control;
     int k_min;
     bool ch_active;
     bool abort_on_conn;
     std::string bridge_ip;
+    unsigned int reactors;
+    bool io_uring;
+    bool prestage;
+    unsigned int tick_workers;
+    unsigned int groups;
+    std::string group_by;
 };
 
 
@@ -67,12 +77,22 @@ void parse_args(int argc, char* argv[], params &p)
     parser.add<std::string>("bridge_ssl_key", 'x', "Bridge SSL private key path", false, "../certs/bridge_private.key");
     parser.add<unsigned int>("chunk", 'c', "Frame chunk size in bytes", false, 3125);
     parser.add<unsigned int>("max_chunks", 'C', "Max number of chunks that compose a frame", false, 1);
+    parser.add<std::string>("frame_sizing", 'F', "Data frame size (fixed: up to max_chunks / auto: grows with the queued data)", false, "fixed");
     parser.add<unsigned int>("ts_min", 'n', "Traffic Shaper minimum rating in microsseconds", false, 5000);
     parser.add<unsigned int>("ts_max", 'N', "Traffic Shaper maximum rating in microsseconds", false, 15000);
+    parser.add<std::string>("ts_overrun", 'O', "Traffic Shaper policy for late ticks (catchup/skip)", false, "skip");
+    parser.add<unsigned int>("ts_burst", 'K', "Traffic Shaper chunks sent per client and tick, 0 for one chunk at constant rate", false, 0);
+    parser.add<std::string>("ts_control", 'T', "Traffic Shaper rate control (adaptive/linear) (bridge mode only)", false, "adaptive");
     parser.add<int>("k_min", 'k', "Min number of users in the same KCircuit (client mode only)", false, -1);
     parser.add<bool>("ch_active", 'a', "Request Tor channel to be active by default (client mode only)", false, false);
     parser.add<bool>("abort_on_conn", 'A', "Abort client when bridge connection fails (client mode only)", false, false);
     parser.add<std::string>("bridge_ip", 'B', "Bridge IP (chaff mode only)", false, "127.0.0.1");
+    parser.add<unsigned int>("reactors", 'R', "Number of event-loop threads sharing the clients (bridge mode only)", false, 1);
+    parser.add<bool>("io_uring", 'U', "Send client traffic through io_uring in one batch per tick (bridge mode only)", false, false);
+    parser.add<bool>("prestage", 'P', "Encrypt the chunks of each client ahead of the Traffic Shaper tick, needs --io_uring (bridge mode only)", false, false);
+    parser.add<unsigned int>("tick_workers", 'W', "Extra threads sending the chunks of each Traffic Shaper tick (bridge mode only)", false, 0);
+    parser.add<unsigned int>("groups", 'G', "Number of anonymity groups, each with its own rate and k-anonymity set (bridge mode only)", false, 1);
+    parser.add<std::string>("group_by", 'g', "Anonymity group of a client (kmin/capacity) (bridge mode only)", false, "kmin");
     parser.parse_check(argc, argv);
 
     p.mode              = parser.get<std::string>("mode");
@@ -81,18 +101,70 @@ void parse_args(int argc, char* argv[], params &p)
     p.bridge_ssl_key    = parser.get<std::string>("bridge_ssl_key");
     p.max_chunks        = parser.get<unsigned int>("max_chunks");
     p.chunk_size        = parser.get<unsigned int>("chunk");
+    p.frame_sizing      = parser.get<std::string>("frame_sizing");
     p.ts_min            = parser.get<unsigned int>("ts_min");
     p.ts_max            = parser.get<unsigned int>("ts_max");
+    p.ts_overrun        = parser.get<std::string>("ts_overrun");
+    p.ts_burst          = parser.get<unsigned int>("ts_burst");
+    p.ts_control        = parser.get<std::string>("ts_control");
     p.k_min             = parser.get<int>("k_min");
     p.ch_active         = parser.get<bool>("ch_active");
     p.abort_on_conn     = parser.get<bool>("abort_on_conn");
     p.bridge_ip         = parser.get<std::string>("bridge_ip");
+    p.reactors          = parser.get<unsigned int>("reactors");
+    p.io_uring          = parser.get<bool>("io_uring");
+    p.prestage          = parser.get<bool>("prestage");
+    p.tick_workers      = parser.get<unsigned int>("tick_workers");
+    p.groups            = parser.get<unsigned int>("groups");
+    p.group_by          = parser.get<std::string>("group_by");
 
     if (p.mode != "bridge" && p.mode != "client" && p.mode != "chaff") {
         std::cerr << "Invalid mode. Please select bridge, client or chaff" << std::endl;
         exit(0);
     }
 
+    if (p.frame_sizing != "fixed" && p.frame_sizing != "auto") {
+        std::cerr << "Invalid frame sizing. Please select fixed or auto" << std::endl;
+        exit(0);
+    }
+
+    if (p.ts_overrun != "catchup" && p.ts_overrun != "skip") {
+        std::cerr << "Invalid Traffic Shaper overrun policy. Please select catchup or skip" << std::endl;
+        exit(0);
+    }
+
+    if (p.ts_control != "adaptive" && p.ts_control != "linear") {
+        std::cerr << "Invalid Traffic Shaper rate control. Please select adaptive or linear" << std::endl;
+        exit(0);
+    }
+
+    if (p.ts_burst > TS_MAX_BURST) {
+        std::cerr << "Invalid Traffic Shaper burst. Use at most " << TS_MAX_BURST
+                  << " chunks per tick." << std::endl;
+        exit(0);
+    }
+
+    if (p.groups < 1 || p.groups > MAX_GROUPS) {
+        std::cerr << "Invalid number of anonymity groups. Use between 1 and "
+                  << MAX_GROUPS << "." << std::endl;
+        exit(0);
+    }
+
+    if (p.group_by != "kmin" && p.group_by != "capacity") {
+        std::cerr << "Invalid anonymity group policy. Please select kmin or capacity" << std::endl;
+        exit(0);
+    }
+
+    if (p.prestage && !p.io_uring) {
+        std::cerr << "Chunk pre-encryption sends through io_uring. Use it with --io_uring." << std::endl;
+        exit(0);
+    }
+
+    if (p.reactors < 1) {
+        std::cerr << "Invalid number of reactors. Use at least one." << std::endl;
+        exit(0);
+    }
+
     if (p.mode == "bridge") {
         std::ifstream ifile;
         ifile.open(p.bridge_ssl_cert);
@@ -125,8 +197,19 @@ int main(int argc, char* argv[])
     std::cerr << "[TORK]: Running in " << p.mode
               << " mode." << std::endl;
     std::cerr << "[TORK]: Using --max_chunk=" << p.max_chunks
-              << " --chunk_size=" << p.chunk_size << " --ts_min=" << p.ts_min
-              << " --ts_max=" << p.ts_max << std::endl;
+              << " --chunk_size=" << p.chunk_size
+              << " --frame_sizing=" << p.frame_sizing << " --ts_min=" << p.ts_min
+              << " --ts_max=" << p.ts_max << " --ts_overrun=" << p.ts_overrun
+              << " --ts_burst=" << p.ts_burst << std::endl;
+
+    int strategy = (p.ts_burst > 0) ? TS_STRATEGY_BURST : TS_STRATEGY_CONSTANT;
+    int burst = (p.ts_burst > 0) ? p.ts_burst : 1;
+
+    int overrun = (p.ts_overrun == "catchup") ? TS_OVERRUN_CATCHUP
+                                              : TS_OVERRUN_SKIP;
+
+    int sizing = (p.frame_sizing == "auto") ? FRAME_SIZING_AUTO
+                                            : FRAME_SIZING_FIXED;
 
     #if USE_SSL
         SSL_load_error_strings();
@@ -147,7 +230,7 @@ int main(int argc, char* argv[])
                                     p.ts_max, p.k_min, false,
                                     p.abort_on_conn, nullptr, &proxy,
                                     nullptr, &cli_server,
-                                    &traffic_shaper);
+                                    &traffic_shaper, sizing);
 
         //Direct Connect to the bridge IP
         unsigned char ip[4];
@@ -167,8 +250,8 @@ int main(int argc, char* argv[])
             proxy.initialize(&controller, true, fd_bridge, RUN_BACKGROUND);
         #endif
         traffic_shaper.initialize(&controller, p.ts_max,
-                                    TS_STRATEGY_CONSTANT, TS_STATE_ON,
-                                    RUN_BACKGROUND);
+                                    strategy, TS_STATE_ON,
+                                    RUN_BACKGROUND, 1, overrun, burst);
 
         cli_server.initialize(&controller, RUN_FOREGROUND);
 
@@ -194,7 +277,7 @@ int main(int argc, char* argv[])
                                     p.ts_max, p.k_min, p.ch_active,
                                     p.abort_on_conn, &pt, &proxy,
                                     &tor_controller, &cli_server,
-                                    &traffic_shaper);
+                                    &traffic_shaper, sizing);
 
         controller.config(p.port, 9061);
 
@@ -207,8 +290,8 @@ int main(int argc, char* argv[])
         #endif
         tor_controller.initialize(&controller, RUN_BACKGROUND);
         traffic_shaper.initialize(&controller, p.ts_max,
-                                    TS_STRATEGY_CONSTANT, TS_STATE_ON,
-                                    RUN_BACKGROUND);
+                                    strategy, TS_STATE_ON,
+                                    RUN_BACKGROUND, 1, overrun, burst);
 
         if (pt.exitOnStdinClose()) {
             cli_server.initialize(&controller, RUN_BACKGROUND);
@@ -236,7 +319,23 @@ int main(int argc, char* argv[])
         TrafficShaper traffic_shaper;
         ControllerServer controller(p.max_chunks, p.chunk_size, p.ts_min,
                                     p.ts_max, &pt, &proxy, &cli_server,
-                                    &traffic_shaper);
+                                    &traffic_shaper, p.reactors,
+                                    p.tick_workers,
+                                    (p.ts_control == "linear") ?
+                                        TS_RATE_CONTROL_LINEAR :
+                                        TS_RATE_CONTROL_ADAPTIVE,
+                                    p.groups,
+                                    (p.group_by == "capacity") ?
+                                        GROUP_BY_CAPACITY : GROUP_BY_KMIN,
+                                    sizing, p.prestage);
+
+        std::cerr << "[TORK]: Bridge configured with --reactors="
+                  << p.reactors << " --io_uring=" << p.io_uring
+                  << " --prestage=" << p.prestage
+                  << " --tick_workers=" << p.tick_workers
+                  << " --ts_control=" << p.ts_control
+                  << " --groups=" << p.groups
+                  << " --group_by=" << p.group_by << std::endl;
 
         pt.initialize(&controller, RUN_FOREGROUND);
         #if USE_SSL
@@ -244,14 +343,16 @@ int main(int argc, char* argv[])
             LoadSSLCertificate(ctx, p.bridge_ssl_cert.c_str(),
                                p.bridge_ssl_key.c_str());
             proxy.initialize(&controller, ctx, p.port,
-                             std::stoi(pt.getOnionPort()), RUN_BACKGROUND);
+                             std::stoi(pt.getOnionPort()), RUN_BACKGROUND,
+                             p.reactors, p.io_uring);
         #else
             proxy.initialize(&controller, p.port,
-                             std::stoi(pt.getOnionPort()), RUN_BACKGROUND);
+                             std::stoi(pt.getOnionPort()), RUN_BACKGROUND,
+                             p.reactors, p.io_uring);
         #endif
         traffic_shaper.initialize(&controller, p.ts_max,
-                                    TS_STRATEGY_CONSTANT, TS_STATE_IDLE,
-                                    RUN_BACKGROUND);
+                                    strategy, TS_STATE_IDLE,
+                                    RUN_BACKGROUND, p.reactors, overrun, burst);
 
         if (pt.exitOnStdinClose()) {
             cli_server.initialize(&controller, RUN_BACKGROUND);